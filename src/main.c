@@ -1,160 +1,46 @@
 #include <gtk/gtk.h>
+#include <glib-unix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ifaddrs.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
-#include <sys/socket.h>
-#include <pthread.h>
-#include <semaphore.h>
-#include <unistd.h>
-#include <netdb.h>
-#include <fcntl.h>
-#include <sys/time.h>
-#include <errno.h>
-#include <net/if.h>
-#include <sys/wait.h>
-
-typedef struct {
-    char ip[64];
-    char status[16];
-    char hostname[256];
-    char mac[32];
-    char ports[256];
-} host_info;
+#include "netmapper.h"
 
 typedef struct {
     GtkListStore *store;
     GtkWidget *progress_label;
+    GtkWidget *topo_entry;
     char network[64];
     uint32_t net_start;
     uint32_t net_end;
     int timeout_ms;
-    int max_threads;
-    sem_t sem;
-    uint32_t total_ips;
-    uint32_t scanned;
+    int max_hosts;
+    netmapper_scan *scan;
+    guint scan_source;
+    netmapper_topo *topo;
+    guint topo_source;
 } scan_context;
 
-typedef struct {
-    char ip[64];
-    scan_context *ctx;
-} thread_arg;
-
-static int get_ipv4_network(uint32_t *start, uint32_t *end, char *netstr, size_t netsz) {
-    struct ifaddrs *ifaddr = NULL, *ifa;
-    if (getifaddrs(&ifaddr) != 0) return -1;
-    for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
-        if (!ifa->ifa_addr) continue;
-        if (ifa->ifa_addr->sa_family == AF_INET) {
-            if (!(ifa->ifa_flags & IFF_UP)) continue;
-            if (ifa->ifa_flags & IFF_LOOPBACK) continue;
-            struct sockaddr_in *sin = (struct sockaddr_in*)ifa->ifa_addr;
-            struct sockaddr_in *mask = (struct sockaddr_in*)ifa->ifa_netmask;
-            if (!sin || !mask) continue;
-            uint32_t addr = ntohl(sin->sin_addr.s_addr);
-            uint32_t m = ntohl(mask->sin_addr.s_addr);
-            if (m == 0) continue;
-            uint32_t net = addr & m;
-            uint32_t broadcast = net | (~m);
-            uint32_t s = net + 1;
-            uint32_t e = broadcast - 1;
-            if (s == 0 || e == 0 || e < s) {
-                continue;
-            }
-            *start = s;
-            *end = e;
-            struct in_addr net_a;
-            net_a.s_addr = htonl(net);
-            inet_ntop(AF_INET, &net_a, netstr, netsz);
-            freeifaddrs(ifaddr);
-            return 0;
-        }
-    }
-    freeifaddrs(ifaddr);
-    return -1;
-}
-
-static int ping_ip(const char *ip, int timeout_s) {
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "ping -c 1 -W %d %s > /dev/null 2>&1", timeout_s, ip);
-    int st = system(cmd);
-    if (st == -1) return 0;
-    if (WIFEXITED(st) && WEXITSTATUS(st) == 0) return 1;
-    return 0;
-}
-
-static int get_mac_from_arp(const char *ip, char *mac_out, size_t mac_out_sz) {
-    FILE *f = fopen("/proc/net/arp", "r");
-    if (!f) return 0;
-    char line[512];
-    fgets(line, sizeof(line), f);
-    while (fgets(line, sizeof(line), f)) {
-        char ipbuf[64], hw[64], rest[256];
-        int fields = sscanf(line, "%63s %*s %*s %63s %*s %255s", ipbuf, hw, rest);
-        if (fields >= 2 && strcmp(ipbuf, ip) == 0) {
-            strncpy(mac_out, hw, mac_out_sz - 1);
-            mac_out[mac_out_sz - 1] = 0;
-            fclose(f);
-            return 1;
-        }
-    }
-    fclose(f);
-    return 0;
-}
-
-static void lookup_hostname(const char *ip, char *hbuf, size_t hbuf_sz) {
-    struct sockaddr_in sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    inet_pton(AF_INET, ip, &sa.sin_addr);
-    char host[NI_MAXHOST] = {0};
-    if (getnameinfo((struct sockaddr*)&sa, sizeof(sa), host, sizeof(host), NULL, 0, 0) == 0) {
-        strncpy(hbuf, host, hbuf_sz - 1);
-        hbuf[hbuf_sz - 1] = 0;
-    } else {
-        hbuf[0] = 0;
+static void update_progress(scan_context *ctx) {
+    static const char *stage_names[NETMAPPER_STAGE_COUNT] = {"discovery", "enrich", "ports", "service"};
+    uint32_t scanned = 0, total = 0;
+    if (ctx->scan) netmapper_get_progress(ctx->scan, &scanned, &total);
+    char buf[512];
+    snprintf(buf, sizeof(buf), "Scanned: %u / %u", scanned, total);
+    for (int st = 0; ctx->scan && st < NETMAPPER_STAGE_COUNT; st++) {
+        netmapper_stage_stats stats;
+        if (netmapper_get_stage_stats(ctx->scan, st, &stats) != 0) continue;
+        char part[96];
+        snprintf(part, sizeof(part), "   %s: %u queued, %u/%u active",
+            stage_names[st], stats.queued, stats.in_flight, stats.limit);
+        strncat(buf, part, sizeof(buf)-strlen(buf)-1);
     }
+    gtk_label_set_text(GTK_LABEL(ctx->progress_label), buf);
 }
 
-static int scan_port_connect(const char *ip, int port, int timeout_ms) {
-    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (sock < 0) return 0;
-    int flags = fcntl(sock, F_GETFL, 0);
-    if (flags >= 0) fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-    struct sockaddr_in sa;
-    memset(&sa, 0, sizeof(sa));
-    sa.sin_family = AF_INET;
-    sa.sin_port = htons(port);
-    inet_pton(AF_INET, ip, &sa.sin_addr);
-    int r = connect(sock, (struct sockaddr*)&sa, sizeof(sa));
-    if (r == 0) { close(sock); return 1; }
-    if (errno != EINPROGRESS) { close(sock); return 0; }
-    fd_set wfds;
-    FD_ZERO(&wfds);
-    FD_SET(sock, &wfds);
-    struct timeval tv;
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000;
-    int s = select(sock + 1, NULL, &wfds, NULL, &tv);
-    if (s <= 0) { close(sock); return 0; }
-    int err = 0;
-    socklen_t len = sizeof(err);
-    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0) { close(sock); return 0; }
-    close(sock);
-    return err == 0;
-}
-
-typedef struct {
-    host_info *h;
-    scan_context *ctx;
-} gui_update;
-
-static gboolean add_host_to_store(gpointer data) {
-    gui_update *u = (gui_update*)data;
-    host_info *h = u->h;
-    scan_context *ctx = u->ctx;
+static void add_host_to_store(const netmapper_host *h, void *user_data) {
+    scan_context *ctx = (scan_context*)user_data;
     GtkTreeIter iter;
     gtk_list_store_append(ctx->store, &iter);
     gtk_list_store_set(ctx->store, &iter,
@@ -163,90 +49,145 @@ static gboolean add_host_to_store(gpointer data) {
         2, h->hostname[0] ? h->hostname : "-",
         3, h->mac[0] ? h->mac : "-",
         4, h->ports[0] ? h->ports : "-",
+        5, h->udp_ports[0] ? h->udp_ports : "-",
+        6, h->services[0] ? h->services : "-",
         -1);
-    ctx->scanned++;
-    char buf[128];
-    snprintf(buf, sizeof(buf), "Scanned: %u / %u", ctx->scanned, ctx->total_ips);
-    gtk_label_set_text(GTK_LABEL(ctx->progress_label), buf);
-    free(h);
-    free(u);
-    return FALSE;
 }
 
-static void *worker_thread(void *arg) {
-    thread_arg *t = (thread_arg*)arg;
-    if (!t) return NULL;
-    char ipbuf_local[64];
-    strncpy(ipbuf_local, t->ip, sizeof(ipbuf_local)-1);
-    ipbuf_local[sizeof(ipbuf_local)-1] = 0;
-    scan_context *ctx = t->ctx;
-    free(t);
-    host_info *h = malloc(sizeof(host_info));
-    if (!h) {
-        sem_post(&ctx->sem);
-        return NULL;
+static gboolean on_scan_ready(gint fd, GIOCondition cond, gpointer user_data) {
+    scan_context *ctx = (scan_context*)user_data;
+    int r = netmapper_process(ctx->scan);
+    update_progress(ctx);
+    if (r == 1) return G_SOURCE_CONTINUE;
+    if (r < 0) fprintf(stderr, "Scan aborted\n");
+    ctx->scan_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static int export_topology(const netmapper_topo *topo) {
+    FILE *dot = fopen("netmapper-topology.dot", "w");
+    if (!dot) return -1;
+    int r = netmapper_topo_export_dot(topo, dot);
+    fclose(dot);
+    FILE *json = fopen("netmapper-topology.json", "w");
+    if (!json) return -1;
+    if (netmapper_topo_export_json(topo, json) != 0) r = -1;
+    fclose(json);
+    return r;
+}
+
+static gboolean on_topo_ready(gint fd, GIOCondition cond, gpointer user_data) {
+    scan_context *ctx = (scan_context*)user_data;
+    int r = netmapper_topo_process(ctx->topo);
+    uint32_t sent = 0, replies = 0;
+    netmapper_topo_get_progress(ctx->topo, &sent, &replies);
+    char buf[256];
+    if (r == 1) {
+        snprintf(buf, sizeof(buf), "Mapping topology: %u probes sent, %u replies", sent, replies);
+    } else if (r < 0) {
+        snprintf(buf, sizeof(buf), "Topology mapping aborted");
+    } else if (export_topology(ctx->topo) != 0) {
+        snprintf(buf, sizeof(buf), "Failed to write topology files");
+    } else {
+        snprintf(buf, sizeof(buf), "Topology (%u probes, %u replies) written to netmapper-topology.dot and netmapper-topology.json", sent, replies);
     }
-    memset(h, 0, sizeof(host_info));
-    strncpy(h->ip, ipbuf_local, sizeof(h->ip)-1);
-    int alive = ping_ip(ipbuf_local, ctx->timeout_ms > 1000 ? ctx->timeout_ms / 1000 : 1);
-    if (alive) strncpy(h->status, "Alive", sizeof(h->status)-1);
-    else strncpy(h->status, "Dead", sizeof(h->status)-1);
-    if (alive) {
-        get_mac_from_arp(ipbuf_local, h->mac, sizeof(h->mac));
-        lookup_hostname(ipbuf_local, h->hostname, sizeof(h->hostname));
-        const int ports_to_check[] = {21,22,23,53,80,443,445,135,139,3389,5900,8080};
-        char portsbuf[256] = {0};
-        int first = 1;
-        for (size_t i = 0; i < sizeof(ports_to_check)/sizeof(int); i++) {
-            int p = ports_to_check[i];
-            if (scan_port_connect(ipbuf_local, p, ctx->timeout_ms)) {
-                if (!first) strncat(portsbuf, ",", sizeof(portsbuf)-strlen(portsbuf)-1);
-                char tmp[16];
-                snprintf(tmp, sizeof(tmp), "%d", p);
-                strncat(portsbuf, tmp, sizeof(portsbuf)-strlen(portsbuf)-1);
-                first = 0;
-            }
+    gtk_label_set_text(GTK_LABEL(ctx->progress_label), buf);
+    if (r == 1) return G_SOURCE_CONTINUE;
+    ctx->topo_source = 0;
+    return G_SOURCE_REMOVE;
+}
+
+/* Adds comma or space separated targets: a.b.c.d, a.b.c.d-e.f.g.h or a.b.c.d/nn. Returns hosts added, -1 on a bad entry. */
+static int add_topology_targets(netmapper_topo *topo, const char *text) {
+    char buf[1024];
+    strncpy(buf, text, sizeof(buf)-1);
+    buf[sizeof(buf)-1] = 0;
+    long total = 0;
+    char *save = NULL;
+    for (char *tok = strtok_r(buf, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save)) {
+        char *sep = strpbrk(tok, "-/");
+        char c = sep ? *sep : 0;
+        if (sep) *sep = 0;
+        struct in_addr a, b;
+        if (inet_pton(AF_INET, tok, &a) != 1) return -1;
+        uint32_t start = ntohl(a.s_addr), end = start;
+        if (c == '-') {
+            if (inet_pton(AF_INET, sep + 1, &b) != 1) return -1;
+            end = ntohl(b.s_addr);
+        } else if (c == '/') {
+            int bits = atoi(sep + 1);
+            if (bits < 16 || bits > 32) return -1;
+            uint32_t mask = bits == 32 ? 0xffffffffu : ~(0xffffffffu >> bits);
+            start &= mask;
+            end = start | ~mask;
         }
-        strncpy(h->ports, portsbuf, sizeof(h->ports)-1);
+        if (end < start) return -1;
+        total += (long)(end - start) + 1;
+        if (total > 65536 || netmapper_topo_add_range(topo, start, end) != 0) return -1;
+    }
+    return (int)total;
+}
+
+static void start_topology(GtkButton *btn, gpointer user_data) {
+    scan_context *ctx = (scan_context*)user_data;
+    if (ctx->topo_source) {
+        g_source_remove(ctx->topo_source);
+        ctx->topo_source = 0;
+    }
+    netmapper_topo_free(ctx->topo);
+    ctx->topo = netmapper_topo_new();
+    if (!ctx->topo) return;
+    const char *text = gtk_entry_get_text(GTK_ENTRY(ctx->topo_entry));
+    int targets = add_topology_targets(ctx->topo, text);
+    if (targets < 0) {
+        gtk_label_set_text(GTK_LABEL(ctx->progress_label), "Bad topology target; use addresses, a.b.c.d-e.f.g.h or a.b.c.d/nn (at most 65536 hosts)");
+        return;
+    }
+    GtkTreeIter iter;
+    /* With no targets entered, trace the live hosts of the last scan. */
+    gboolean valid = targets == 0 && gtk_tree_model_get_iter_first(GTK_TREE_MODEL(ctx->store), &iter);
+    while (valid) {
+        gchar *ip = NULL, *status = NULL;
+        gtk_tree_model_get(GTK_TREE_MODEL(ctx->store), &iter, 0, &ip, 1, &status, -1);
+        if (ip && status && strcmp(status, "Alive") == 0 && netmapper_topo_add_target(ctx->topo, ip) == 0) targets++;
+        g_free(ip);
+        g_free(status);
+        valid = gtk_tree_model_iter_next(GTK_TREE_MODEL(ctx->store), &iter);
+    }
+    if (!targets) {
+        gtk_label_set_text(GTK_LABEL(ctx->progress_label), "Enter targets to map, or run a scan first");
+        return;
     }
-    gui_update *u = malloc(sizeof(gui_update));
-    if (!u) {
-        free(h);
-        sem_post(&ctx->sem);
-        return NULL;
+    if (netmapper_topo_start(ctx->topo) != 0) {
+        fprintf(stderr, "Failed to start topology mapping\n");
+        return;
     }
-    u->h = h;
-    u->ctx = ctx;
-    g_idle_add(add_host_to_store, u);
-    sem_post(&ctx->sem);
-    return NULL;
+    ctx->topo_source = g_unix_fd_add(netmapper_topo_get_fd(ctx->topo), G_IO_IN, on_topo_ready, ctx);
 }
 
 static void start_scan(GtkButton *btn, gpointer user_data) {
     scan_context *ctx = (scan_context*)user_data;
+    if (ctx->scan_source) {
+        g_source_remove(ctx->scan_source);
+        ctx->scan_source = 0;
+    }
+    netmapper_scan_free(ctx->scan);
     gtk_list_store_clear(ctx->store);
-    ctx->scanned = 0;
-    ctx->total_ips = (ctx->net_end >= ctx->net_start) ? (ctx->net_end - ctx->net_start + 1) : 0;
-    if (ctx->total_ips == 0) return;
-    if (ctx->total_ips > 65536) ctx->total_ips = 65536;
-    char buf[128];
-    snprintf(buf, sizeof(buf), "Scanned: %u / %u", ctx->scanned, ctx->total_ips);
-    gtk_label_set_text(GTK_LABEL(ctx->progress_label), buf);
-    for (uint32_t ip = ctx->net_start; ip <= ctx->net_end; ip++) {
-        sem_wait(&ctx->sem);
-        struct in_addr a;
-        a.s_addr = htonl(ip);
-        thread_arg *t = malloc(sizeof(thread_arg));
-        if (!t) {
-            sem_post(&ctx->sem);
-            continue;
-        }
-        inet_ntop(AF_INET, &a, t->ip, sizeof(t->ip));
-        t->ctx = ctx;
-        pthread_t tid;
-        pthread_create(&tid, NULL, worker_thread, t);
-        pthread_detach(tid);
+    ctx->scan = netmapper_scan_new();
+    if (!ctx->scan) return;
+    uint32_t end = ctx->net_end;
+    if (end - ctx->net_start >= 65536) end = ctx->net_start + 65535;
+    netmapper_set_timeout(ctx->scan, ctx->timeout_ms);
+    netmapper_set_concurrency(ctx->scan, ctx->max_hosts);
+    netmapper_set_callback(ctx->scan, add_host_to_store, ctx);
+    if (netmapper_add_range(ctx->scan, ctx->net_start, end) != 0 ||
+        netmapper_add_default_udp_ports(ctx->scan) != 0 ||
+        netmapper_start(ctx->scan) != 0) {
+        fprintf(stderr, "Failed to start scan\n");
+        return;
     }
+    update_progress(ctx);
+    ctx->scan_source = g_unix_fd_add(netmapper_get_fd(ctx->scan), G_IO_IN, on_scan_ready, ctx);
 }
 
 int main(int argc, char **argv) {
@@ -255,8 +196,8 @@ int main(int argc, char **argv) {
     if (!ctx) return 1;
     memset(ctx, 0, sizeof(scan_context));
     ctx->timeout_ms = 200;
-    ctx->max_threads = 50;
-    if (get_ipv4_network(&ctx->net_start, &ctx->net_end, ctx->network, sizeof(ctx->network)) != 0) {
+    ctx->max_hosts = 2048;
+    if (netmapper_detect_network(&ctx->net_start, &ctx->net_end, ctx->network, sizeof(ctx->network)) != 0) {
         fprintf(stderr, "Failed to detect local network\n");
         free(ctx);
         return 1;
@@ -266,12 +207,7 @@ int main(int argc, char **argv) {
         free(ctx);
         return 1;
     }
-    if (ctx->max_threads < 1) ctx->max_threads = 1;
-    if (sem_init(&ctx->sem, 0, ctx->max_threads) != 0) {
-        fprintf(stderr, "Failed to initialize semaphore\n");
-        free(ctx);
-        return 1;
-    }
+    if (ctx->max_hosts < 1) ctx->max_hosts = 1;
     GtkWidget *win = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_default_size(GTK_WINDOW(win), 1000, 500);
     gtk_window_set_title(GTK_WINDOW(win), "NetMapper - Network Scanner");
@@ -293,7 +229,13 @@ int main(int argc, char **argv) {
     gtk_box_pack_start(GTK_BOX(hbox), label, FALSE, FALSE, 6);
     GtkWidget *scanbtn = gtk_button_new_with_label("Start Scan");
     gtk_box_pack_end(GTK_BOX(hbox), scanbtn, FALSE, FALSE, 6);
-    GtkListStore *store = gtk_list_store_new(5, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
+    GtkWidget *topobtn = gtk_button_new_with_label("Map Topology");
+    gtk_box_pack_end(GTK_BOX(hbox), topobtn, FALSE, FALSE, 6);
+    ctx->topo_entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(ctx->topo_entry), "Targets to map, e.g. 192.0.2.0/24 (default: live hosts)");
+    gtk_entry_set_width_chars(GTK_ENTRY(ctx->topo_entry), 40);
+    gtk_box_pack_end(GTK_BOX(hbox), ctx->topo_entry, FALSE, FALSE, 6);
+    GtkListStore *store = gtk_list_store_new(7, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING);
     ctx->store = store;
     GtkWidget *tree = gtk_tree_view_new_with_model(GTK_TREE_MODEL(store));
     GtkCellRenderer *renderer = gtk_cell_renderer_text_new();
@@ -307,6 +249,10 @@ int main(int argc, char **argv) {
     gtk_tree_view_append_column(GTK_TREE_VIEW(tree), col_mac);
     GtkTreeViewColumn *col_ports = gtk_tree_view_column_new_with_attributes("Open Ports", renderer, "text", 4, NULL);
     gtk_tree_view_append_column(GTK_TREE_VIEW(tree), col_ports);
+    GtkTreeViewColumn *col_udp = gtk_tree_view_column_new_with_attributes("UDP Services", renderer, "text", 5, NULL);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(tree), col_udp);
+    GtkTreeViewColumn *col_services = gtk_tree_view_column_new_with_attributes("Services", renderer, "text", 6, NULL);
+    gtk_tree_view_append_column(GTK_TREE_VIEW(tree), col_services);
     GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
     gtk_widget_set_vexpand(scrolled, TRUE);
     gtk_container_add(GTK_CONTAINER(scrolled), tree);
@@ -314,9 +260,11 @@ int main(int argc, char **argv) {
     ctx->progress_label = gtk_label_new("");
     gtk_box_pack_start(GTK_BOX(vbox), ctx->progress_label, FALSE, FALSE, 6);
     g_signal_connect(scanbtn, "clicked", G_CALLBACK(start_scan), ctx);
+    g_signal_connect(topobtn, "clicked", G_CALLBACK(start_topology), ctx);
     gtk_widget_show_all(win);
     gtk_main();
-    sem_destroy(&ctx->sem);
+    netmapper_scan_free(ctx->scan);
+    netmapper_topo_free(ctx->topo);
     free(ctx);
     return 0;
 }
@@ -0,0 +1,1411 @@
+#define _GNU_SOURCE
+#include "netmapper.h"
+#include "nm_common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <net/if.h>
+#include <linux/errqueue.h>
+
+#define NM_DEFAULT_TIMEOUT_MS 200
+#define NM_DEFAULT_MAX_HOSTS 2048
+#define NM_MAX_SOCKETS 512
+#define NM_MAX_EVENTS 64
+#define NM_UDP_BATCH 64
+#define NM_UDP_BUFSZ 512
+#define NM_DEFAULT_UDP_LIMIT 4096
+#define NM_BANNER_PORTS 8
+#define NM_BANNER_MAX 64
+/* ICMP_FILTER from <linux/icmp.h>, which clashes with <netinet/ip_icmp.h>. */
+#define NM_ICMP_FILTER 1
+
+enum { EV_TIMER = 1, EV_ICMP, EV_DNS, EV_CONN, EV_UDP };
+enum { PH_IDLE, PH_DISCOVERY_Q, PH_DISCOVERY, PH_PORTS_Q, PH_PORTS, PH_SERVICE_Q, PH_SERVICE, PH_DONE };
+enum { EN_NONE, EN_QUEUED, EN_ACTIVE, EN_DONE };
+enum { CONN_CLOSED, CONN_OPEN, CONN_REFUSED };
+enum { CONN_PORT, CONN_BANNER };
+enum { UDP_UNKNOWN, UDP_OPEN, UDP_CLOSED, UDP_FILTERED };
+
+typedef struct {
+    int fd;
+    int slot;
+    int port_idx;
+    int purpose;
+    int reading;
+    int connect_rc;
+    uint64_t deadline;
+} conn_entry;
+
+/*
+ * A host moves down the main line (discovery -> ports -> service) while
+ * enrichment runs as a side branch once it is known to be alive. UDP probing
+ * is a second side branch started when discovery ends, so waiting for silent
+ * UDP ports holds only the slot, not a stage seat. The slot is released when
+ * all three have finished.
+ */
+typedef struct {
+    int phase;
+    int enrich;
+    int seats;
+    uint32_t addr;
+    int alive;
+    uint64_t ping_deadline;
+    uint64_t dns_deadline;
+    int dns_pending;
+    size_t next_port;
+    int ports_pending;
+    unsigned char *open;
+    int udp_branch;
+    size_t next_udp;
+    int udp_outstanding;
+    uint64_t udp_deadline;
+    unsigned char *udp_state;
+    int services_pending;
+    netmapper_host host;
+} host_slot;
+
+/* Bounded ring of slot indices feeding one stage, plus that stage's concurrency budget. */
+typedef struct {
+    int *ring;
+    int cap;
+    int head;
+    int len;
+    int reserved;
+    int limit;
+    int in_flight;
+    uint32_t peak;
+    uint32_t completed;
+} stage_queue;
+
+typedef struct {
+    uint32_t addr;
+    int slot;
+} addr_entry;
+
+typedef struct {
+    struct mmsghdr tx[NM_UDP_BATCH];
+    struct iovec tx_iov[NM_UDP_BATCH];
+    struct sockaddr_in tx_addr[NM_UDP_BATCH];
+    int tx_slot[NM_UDP_BATCH];
+    int tx_udp_idx[NM_UDP_BATCH];
+    int tx_count;
+    struct mmsghdr rx[NM_UDP_BATCH];
+    struct iovec rx_iov[NM_UDP_BATCH];
+    struct sockaddr_in rx_addr[NM_UDP_BATCH];
+    uint8_t rx_buf[NM_UDP_BATCH][NM_UDP_BUFSZ];
+    uint8_t rx_ctrl[NM_UDP_BATCH][128];
+} udp_batch;
+
+typedef struct {
+    int port;
+    const uint8_t *data;
+    size_t len;
+} udp_payload;
+
+struct netmapper_scan {
+    int epfd;
+    int timerfd;
+    int icmpfd;
+    int icmp_raw;
+    uint16_t echo_id;
+    int dnsfd;
+    int udpfd;
+    int timeout_ms;
+    int max_hosts;
+    int udp_limit;
+    int udp_in_flight;
+    int tcp_disabled;
+    netmapper_result_cb cb;
+    void *user_data;
+    uint32_t *targets;
+    size_t ntargets;
+    size_t cap_targets;
+    size_t next_target;
+    int *ports;
+    size_t nports;
+    size_t cap_ports;
+    int *udp_ports;
+    size_t nudp;
+    size_t cap_udp;
+    int *udp_port_index;
+    addr_entry *addr_map;
+    size_t addr_map_mask;
+    udp_batch *udp;
+    host_slot *slots;
+    int *free_slots;
+    int nfree_slots;
+    stage_queue stages[NETMAPPER_STAGE_COUNT];
+    conn_entry *conns;
+    int *free_conns;
+    int nfree_conns;
+    uint32_t completed;
+    int running;
+};
+
+static const int default_ports[] = {21,22,23,53,80,443,445,135,139,3389,5900,8080};
+static const int default_udp_ports[] = {53,123,137,161,1900,5353};
+
+static const uint8_t dns_probe[] = {
+    0x00,0x06, 0x01,0x00, 0x00,0x01, 0x00,0x00, 0x00,0x00, 0x00,0x00,
+    7,'v','e','r','s','i','o','n', 4,'b','i','n','d', 0,
+    0x00,0x10, 0x00,0x03
+};
+static const uint8_t ntp_probe[48] = { 0xe3 };
+static const uint8_t netbios_probe[] = {
+    0x80,0xf0, 0x00,0x00, 0x00,0x01, 0x00,0x00, 0x00,0x00, 0x00,0x00,
+    0x20,'C','K','A','A','A','A','A','A','A','A','A','A','A','A','A','A',
+         'A','A','A','A','A','A','A','A','A','A','A','A','A','A','A','A', 0,
+    0x00,0x21, 0x00,0x01
+};
+static const uint8_t snmp_probe[] = {
+    0x30,0x29, 0x02,0x01,0x00, 0x04,0x06,'p','u','b','l','i','c',
+    0xa0,0x1c, 0x02,0x04,0x4e,0x4d,0x41,0x50, 0x02,0x01,0x00, 0x02,0x01,0x00,
+    0x30,0x0e, 0x30,0x0c, 0x06,0x08,0x2b,0x06,0x01,0x02,0x01,0x01,0x01,0x00, 0x05,0x00
+};
+static const uint8_t ssdp_probe[] =
+    "M-SEARCH * HTTP/1.1\r\n"
+    "HOST: 239.255.255.250:1900\r\n"
+    "MAN: \"ssdp:discover\"\r\n"
+    "MX: 1\r\n"
+    "ST: ssdp:all\r\n\r\n";
+static const uint8_t mdns_probe[] = {
+    0x00,0x00, 0x00,0x00, 0x00,0x01, 0x00,0x00, 0x00,0x00, 0x00,0x00,
+    9,'_','s','e','r','v','i','c','e','s', 7,'_','d','n','s','-','s','d',
+    4,'_','u','d','p', 5,'l','o','c','a','l', 0,
+    0x00,0x0c, 0x00,0x01
+};
+
+static const udp_payload udp_payloads[] = {
+    {53, dns_probe, sizeof(dns_probe)},
+    {123, ntp_probe, sizeof(ntp_probe)},
+    {137, netbios_probe, sizeof(netbios_probe)},
+    {161, snmp_probe, sizeof(snmp_probe)},
+    {1900, ssdp_probe, sizeof(ssdp_probe) - 1},
+    {5353, mdns_probe, sizeof(mdns_probe)},
+};
+
+
+static int add_watch(netmapper_scan *scan, int fd, uint32_t events, int kind, int idx) {
+    return nm_add_watch(scan->epfd, fd, events, ((uint64_t)kind << 32) | (uint32_t)idx);
+}
+
+static int long_timeout_ms(const netmapper_scan *scan) {
+    return scan->timeout_ms > 1000 ? scan->timeout_ms : 1000;
+}
+
+int netmapper_detect_network(uint32_t *start, uint32_t *end, char *netstr, size_t netsz) {
+    struct ifaddrs *ifaddr = NULL, *ifa;
+    if (getifaddrs(&ifaddr) != 0) return -1;
+    for (ifa = ifaddr; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr) continue;
+        if (ifa->ifa_addr->sa_family == AF_INET) {
+            if (!(ifa->ifa_flags & IFF_UP)) continue;
+            if (ifa->ifa_flags & IFF_LOOPBACK) continue;
+            struct sockaddr_in *sin = (struct sockaddr_in*)ifa->ifa_addr;
+            struct sockaddr_in *mask = (struct sockaddr_in*)ifa->ifa_netmask;
+            if (!sin || !mask) continue;
+            uint32_t addr = ntohl(sin->sin_addr.s_addr);
+            uint32_t m = ntohl(mask->sin_addr.s_addr);
+            if (m == 0) continue;
+            uint32_t net = addr & m;
+            uint32_t broadcast = net | (~m);
+            uint32_t s = net + 1;
+            uint32_t e = broadcast - 1;
+            if (s == 0 || e == 0 || e < s) {
+                continue;
+            }
+            *start = s;
+            *end = e;
+            struct in_addr net_a;
+            net_a.s_addr = htonl(net);
+            inet_ntop(AF_INET, &net_a, netstr, netsz);
+            freeifaddrs(ifaddr);
+            return 0;
+        }
+    }
+    freeifaddrs(ifaddr);
+    return -1;
+}
+
+static int get_mac_from_arp(const char *ip, char *mac_out, size_t mac_out_sz) {
+    FILE *f = fopen("/proc/net/arp", "r");
+    if (!f) return 0;
+    char line[512];
+    fgets(line, sizeof(line), f);
+    while (fgets(line, sizeof(line), f)) {
+        char ipbuf[64], hw[64], rest[256];
+        int fields = sscanf(line, "%63s %*s %*s %63s %*s %255s", ipbuf, hw, rest);
+        if (fields >= 2 && strcmp(ipbuf, ip) == 0) {
+            strncpy(mac_out, hw, mac_out_sz - 1);
+            mac_out[mac_out_sz - 1] = 0;
+            fclose(f);
+            return 1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+static int lookup_etc_hosts(const char *ip, char *hbuf, size_t hbuf_sz) {
+    FILE *f = fopen("/etc/hosts", "r");
+    if (!f) return 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char ipbuf[64], name[256];
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%63s %255s", ipbuf, name) != 2) continue;
+        if (strcmp(ipbuf, ip) == 0) {
+            strncpy(hbuf, name, hbuf_sz - 1);
+            hbuf[hbuf_sz - 1] = 0;
+            fclose(f);
+            return 1;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* ---------------- ICMP echo (liveness) ---------------- */
+
+static uint16_t inet_checksum(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint32_t sum = 0;
+    while (len > 1) {
+        sum += (p[0] << 8) | p[1];
+        p += 2;
+        len -= 2;
+    }
+    if (len) sum += p[0] << 8;
+    while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+static int open_icmp_socket(netmapper_scan *scan) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    scan->icmp_raw = 0;
+    if (fd < 0) {
+        fd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+        if (fd < 0) return -1;
+        scan->icmp_raw = 1;
+        /* A raw socket sees every ICMP packet on the host; keep only echo replies so they are not crowded out. */
+        uint32_t filter = ~(1u << ICMP_ECHOREPLY);
+        setsockopt(fd, SOL_RAW, NM_ICMP_FILTER, &filter, sizeof(filter));
+    }
+    int bufsz = 1 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+    return fd;
+}
+
+static int send_echo(netmapper_scan *scan, int slot) {
+    uint8_t pkt[sizeof(struct icmphdr) + 16];
+    memset(pkt, 0, sizeof(pkt));
+    struct icmphdr *icmp = (struct icmphdr*)pkt;
+    icmp->type = ICMP_ECHO;
+    icmp->code = 0;
+    icmp->un.echo.id = htons(scan->echo_id);
+    icmp->un.echo.sequence = htons((uint16_t)slot);
+    icmp->checksum = inet_checksum(pkt, sizeof(pkt));
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(scan->slots[slot].addr);
+    return sendto(scan->icmpfd, pkt, sizeof(pkt), 0, (struct sockaddr*)&sa, sizeof(sa)) < 0 ? -1 : 0;
+}
+
+/* ---------------- Reverse DNS (PTR over UDP) ---------------- */
+
+static int open_dns_socket(void) {
+    FILE *f = fopen("/etc/resolv.conf", "r");
+    if (!f) return -1;
+    char line[256];
+    struct sockaddr_in sa;
+    int found = 0;
+    memset(&sa, 0, sizeof(sa));
+    while (!found && fgets(line, sizeof(line), f)) {
+        char key[32], val[64];
+        if (sscanf(line, "%31s %63s", key, val) != 2) continue;
+        if (strcmp(key, "nameserver") != 0) continue;
+        if (inet_pton(AF_INET, val, &sa.sin_addr) == 1) found = 1;
+    }
+    fclose(f);
+    if (!found) return -1;
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(53);
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void ptr_name(uint32_t addr, char *out, size_t outsz) {
+    snprintf(out, outsz, "%u.%u.%u.%u.in-addr.arpa",
+        addr & 0xff, (addr >> 8) & 0xff, (addr >> 16) & 0xff, addr >> 24);
+}
+
+static int send_ptr_query(netmapper_scan *scan, int slot) {
+    uint8_t q[512];
+    char name[64];
+    ptr_name(scan->slots[slot].addr, name, sizeof(name));
+    memset(q, 0, 12);
+    q[0] = (slot >> 8) & 0xff;
+    q[1] = slot & 0xff;
+    q[2] = 0x01;
+    q[5] = 1;
+    size_t off = 12;
+    const char *label = name;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t n = dot ? (size_t)(dot - label) : strlen(label);
+        q[off++] = (uint8_t)n;
+        memcpy(q + off, label, n);
+        off += n;
+        label += n;
+        if (*label == '.') label++;
+    }
+    q[off++] = 0;
+    q[off++] = 0; q[off++] = 12;
+    q[off++] = 0; q[off++] = 1;
+    return send(scan->dnsfd, q, off, 0) < 0 ? -1 : 0;
+}
+
+static int dns_read_name(const uint8_t *msg, size_t len, size_t off, char *out, size_t outsz, size_t *next) {
+    size_t pos = 0;
+    int jumps = 0;
+    int jumped = 0;
+    out[0] = 0;
+    while (off < len) {
+        uint8_t n = msg[off];
+        if (n == 0) {
+            if (!jumped) *next = off + 1;
+            if (pos > 0) out[pos - 1] = 0;
+            return 0;
+        }
+        if ((n & 0xc0) == 0xc0) {
+            if (off + 1 >= len || ++jumps > 16) return -1;
+            if (!jumped) *next = off + 2;
+            jumped = 1;
+            off = ((n & 0x3f) << 8) | msg[off + 1];
+            continue;
+        }
+        if (off + 1 + n > len || pos + n + 1 >= outsz) return -1;
+        memcpy(out + pos, msg + off + 1, n);
+        pos += n;
+        out[pos++] = '.';
+        out[pos] = 0;
+        off += 1 + n;
+    }
+    return -1;
+}
+
+static int parse_ptr_reply(const uint8_t *msg, size_t len, const char *expect, char *host, size_t hostsz) {
+    if (len < 12 || !(msg[2] & 0x80)) return -1;
+    int qd = (msg[4] << 8) | msg[5];
+    int an = (msg[6] << 8) | msg[7];
+    size_t off = 12;
+    char name[256];
+    if (qd != 1) return -1;
+    if (dns_read_name(msg, len, off, name, sizeof(name), &off) != 0) return -1;
+    if (strcasecmp(name, expect) != 0) return -1;
+    off += 4;
+    host[0] = 0;
+    if ((msg[3] & 0x0f) != 0) return 0;
+    for (int i = 0; i < an && off < len; i++) {
+        if (dns_read_name(msg, len, off, name, sizeof(name), &off) != 0) return 0;
+        if (off + 10 > len) return 0;
+        int type = (msg[off] << 8) | msg[off + 1];
+        size_t rdlen = (msg[off + 8] << 8) | msg[off + 9];
+        off += 10;
+        if (off + rdlen > len) return 0;
+        if (type == 12) {
+            size_t unused;
+            if (dns_read_name(msg, len, off, host, hostsz, &unused) != 0) host[0] = 0;
+            return 0;
+        }
+        off += rdlen;
+    }
+    return 0;
+}
+
+/* ---------------- Address to slot map ---------------- */
+
+static void addr_map_put(netmapper_scan *scan, uint32_t addr, int slot) {
+    if (!scan->addr_map) return;
+    size_t k = nm_addr_hash(addr, scan->addr_map_mask);
+    while (scan->addr_map[k].slot >= 0 && scan->addr_map[k].addr != addr) k = (k + 1) & scan->addr_map_mask;
+    scan->addr_map[k].addr = addr;
+    scan->addr_map[k].slot = slot;
+}
+
+static int addr_map_get(const netmapper_scan *scan, uint32_t addr) {
+    if (!scan->addr_map) return -1;
+    size_t k = nm_addr_hash(addr, scan->addr_map_mask);
+    while (scan->addr_map[k].slot >= 0) {
+        if (scan->addr_map[k].addr == addr) return scan->addr_map[k].slot;
+        k = (k + 1) & scan->addr_map_mask;
+    }
+    return -1;
+}
+
+static void addr_map_del(netmapper_scan *scan, uint32_t addr, int slot) {
+    if (!scan->addr_map) return;
+    size_t mask = scan->addr_map_mask;
+    size_t k = nm_addr_hash(addr, mask);
+    while (scan->addr_map[k].slot >= 0 && scan->addr_map[k].addr != addr) k = (k + 1) & mask;
+    if (scan->addr_map[k].slot != slot) return;
+    /* Backward-shift deletion keeps probe chains intact without tombstones. */
+    size_t hole = k;
+    for (size_t j = (hole + 1) & mask; scan->addr_map[j].slot >= 0; j = (j + 1) & mask) {
+        size_t home = nm_addr_hash(scan->addr_map[j].addr, mask);
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            scan->addr_map[hole] = scan->addr_map[j];
+            hole = j;
+        }
+    }
+    scan->addr_map[hole].slot = -1;
+}
+
+/* ---------------- Pipeline stages ---------------- */
+
+/*
+ * Echo probes are nearly free but a dead host holds its discovery seat for the
+ * full ping wait, so discovery gets a wide budget. Its hosts also reserve seats
+ * in the enrich and ports queues, which are sized to match.
+ */
+static const int default_stage_limit[NETMAPPER_STAGE_COUNT] = {1024, 32, 32, 16};
+static const int default_stage_queue[NETMAPPER_STAGE_COUNT] = {1024, 1024, 1024, 32};
+
+static int stage_room(const stage_queue *st) {
+    return st->len + st->reserved < st->cap;
+}
+
+static int stage_can_run(const stage_queue *st) {
+    return st->len > 0 && st->in_flight < st->limit;
+}
+
+static void stage_reserve(netmapper_scan *scan, int i, int stage) {
+    scan->stages[stage].reserved++;
+    scan->slots[i].seats |= 1 << stage;
+}
+
+static void stage_unreserve(netmapper_scan *scan, int i, int stage) {
+    host_slot *s = &scan->slots[i];
+    if (!(s->seats & (1 << stage))) return;
+    s->seats &= ~(1 << stage);
+    scan->stages[stage].reserved--;
+}
+
+/* Pushes never overflow: the upstream stage reserved a seat before taking the host on. */
+static void stage_push(netmapper_scan *scan, int i, int stage) {
+    stage_queue *st = &scan->stages[stage];
+    stage_unreserve(scan, i, stage);
+    st->ring[(st->head + st->len) % st->cap] = i;
+    st->len++;
+    if ((uint32_t)st->len > st->peak) st->peak = st->len;
+}
+
+static int stage_pop(netmapper_scan *scan, int stage) {
+    stage_queue *st = &scan->stages[stage];
+    int i = st->ring[st->head];
+    st->head = (st->head + 1) % st->cap;
+    st->len--;
+    st->in_flight++;
+    return i;
+}
+
+static void stage_done(netmapper_scan *scan, int stage) {
+    scan->stages[stage].in_flight--;
+    scan->stages[stage].completed++;
+}
+
+/* ---------------- Scan state machine ---------------- */
+
+static void append_port(char *buf, size_t bufsz, int port) {
+    char tmp[16];
+    snprintf(tmp, sizeof(tmp), buf[0] ? ",%d" : "%d", port);
+    strncat(buf, tmp, bufsz-strlen(buf)-1);
+}
+
+static void finish_slot(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    netmapper_host *h = &s->host;
+    strncpy(h->status, s->alive ? "Alive" : "Dead", sizeof(h->status)-1);
+    if (s->alive) {
+        for (size_t p = 0; p < scan->nports; p++) {
+            if (s->open[p]) append_port(h->ports, sizeof(h->ports), scan->ports[p]);
+        }
+        for (size_t u = 0; u < scan->nudp; u++) {
+            if (s->udp_state[u] == UDP_OPEN) append_port(h->udp_ports, sizeof(h->udp_ports), scan->udp_ports[u]);
+        }
+    }
+    addr_map_del(scan, s->addr, i);
+    s->phase = PH_IDLE;
+    scan->free_slots[scan->nfree_slots++] = i;
+    scan->completed++;
+    if (scan->cb) scan->cb(h, scan->user_data);
+}
+
+static void maybe_finish(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    if (s->phase != PH_DONE || s->udp_branch) return;
+    if (s->enrich != EN_NONE && s->enrich != EN_DONE) return;
+    finish_slot(scan, i);
+}
+
+static void enrich_done(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    s->dns_pending = 0;
+    s->enrich = EN_DONE;
+    stage_done(scan, NETMAPPER_STAGE_ENRICH);
+    maybe_finish(scan, i);
+}
+
+static void start_enrich(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    s->enrich = EN_ACTIVE;
+    get_mac_from_arp(s->host.ip, s->host.mac, sizeof(s->host.mac));
+    if (!lookup_etc_hosts(s->host.ip, s->host.hostname, sizeof(s->host.hostname)) &&
+        scan->dnsfd >= 0 && send_ptr_query(scan, i) == 0) {
+        s->dns_pending = 1;
+        s->dns_deadline = nm_now_ms() + long_timeout_ms(scan);
+        return;
+    }
+    enrich_done(scan, i);
+}
+
+static void mark_alive(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    if (s->alive) return;
+    s->alive = 1;
+    if (s->seats & (1 << NETMAPPER_STAGE_ENRICH)) {
+        s->enrich = EN_QUEUED;
+        stage_push(scan, i, NETMAPPER_STAGE_ENRICH);
+    }
+}
+
+/* alive: 1 echo reply, 0 no reply, -1 no ICMP available so the port stage decides. */
+static void discovery_done(netmapper_scan *scan, int i, int alive) {
+    host_slot *s = &scan->slots[i];
+    stage_done(scan, NETMAPPER_STAGE_DISCOVERY);
+    if (alive == 0) {
+        stage_unreserve(scan, i, NETMAPPER_STAGE_ENRICH);
+        stage_unreserve(scan, i, NETMAPPER_STAGE_PORTS);
+        s->phase = PH_DONE;
+        maybe_finish(scan, i);
+        return;
+    }
+    if (alive > 0) mark_alive(scan, i);
+    /* UDP does not wait for a port-stage seat, which filtered TCP ports can hold for the whole timeout. */
+    s->udp_branch = scan->nudp > 0;
+    s->next_udp = 0;
+    s->udp_outstanding = 0;
+    s->phase = PH_PORTS_Q;
+    stage_push(scan, i, NETMAPPER_STAGE_PORTS);
+}
+
+static void service_done(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    s->phase = PH_DONE;
+    stage_done(scan, NETMAPPER_STAGE_SERVICE);
+    maybe_finish(scan, i);
+}
+
+static void ports_check_done(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    if (s->phase != PH_PORTS) return;
+    if (s->next_port < scan->nports || s->ports_pending > 0) return;
+    stage_done(scan, NETMAPPER_STAGE_PORTS);
+    stage_unreserve(scan, i, NETMAPPER_STAGE_ENRICH);
+    int open = 0;
+    for (size_t p = 0; p < scan->nports; p++) open += s->open[p];
+    if (s->alive && open > 0) {
+        s->phase = PH_SERVICE_Q;
+        stage_push(scan, i, NETMAPPER_STAGE_SERVICE);
+        return;
+    }
+    stage_unreserve(scan, i, NETMAPPER_STAGE_SERVICE);
+    s->phase = PH_DONE;
+    maybe_finish(scan, i);
+}
+
+static void release_conn(netmapper_scan *scan, int ci, int result) {
+    conn_entry *c = &scan->conns[ci];
+    int i = c->slot;
+    host_slot *s = &scan->slots[i];
+    close(c->fd);
+    c->fd = -1;
+    scan->free_conns[scan->nfree_conns++] = ci;
+    if (c->purpose == CONN_BANNER) {
+        if (--s->services_pending == 0) service_done(scan, i);
+        return;
+    }
+    s->ports_pending--;
+    if (result == CONN_OPEN) s->open[c->port_idx] = 1;
+    if (result != CONN_CLOSED) mark_alive(scan, i);
+    ports_check_done(scan, i);
+}
+
+static int alloc_conn(netmapper_scan *scan, int i, int port_idx, int purpose, int timeout_ms) {
+    host_slot *s = &scan->slots[i];
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (sock < 0) return -1;
+    int ci = scan->free_conns[--scan->nfree_conns];
+    conn_entry *c = &scan->conns[ci];
+    c->fd = sock;
+    c->slot = i;
+    c->port_idx = port_idx;
+    c->purpose = purpose;
+    c->reading = 0;
+    c->deadline = nm_now_ms() + timeout_ms;
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(scan->ports[port_idx]);
+    sa.sin_addr.s_addr = htonl(s->addr);
+    c->connect_rc = connect(sock, (struct sockaddr*)&sa, sizeof(sa)) == 0 ? 0 : errno;
+    return ci;
+}
+
+static void launch_connect(netmapper_scan *scan, int i, int port_idx) {
+    host_slot *s = &scan->slots[i];
+    int ci = alloc_conn(scan, i, port_idx, CONN_PORT, scan->timeout_ms);
+    if (ci < 0) return;
+    s->ports_pending++;
+    int rc = scan->conns[ci].connect_rc;
+    if (rc == 0) { release_conn(scan, ci, CONN_OPEN); return; }
+    if (rc == ECONNREFUSED) { release_conn(scan, ci, CONN_REFUSED); return; }
+    if (rc != EINPROGRESS || add_watch(scan, scan->conns[ci].fd, EPOLLOUT, EV_CONN, ci) != 0) {
+        release_conn(scan, ci, CONN_CLOSED);
+    }
+}
+
+/* ---------------- Service probing (banner grab) ---------------- */
+
+static int is_http_port(int port) {
+    return port == 80 || port == 8000 || port == 8008 || port == 8080 || port == 8888;
+}
+
+static void record_banner(netmapper_scan *scan, int i, int port, const char *data, size_t len) {
+    netmapper_host *h = &scan->slots[i].host;
+    char line[NM_BANNER_MAX + 1];
+    size_t n = 0;
+    for (size_t k = 0; k < len && n < NM_BANNER_MAX; k++) {
+        if (data[k] == '\r' || data[k] == '\n') break;
+        line[n++] = (data[k] >= 0x20 && data[k] < 0x7f) ? data[k] : '.';
+    }
+    line[n] = 0;
+    if (n == 0) return;
+    char entry[NM_BANNER_MAX + 16];
+    snprintf(entry, sizeof(entry), "%s%d=%s", h->services[0] ? "; " : "", port, line);
+    strncat(h->services, entry, sizeof(h->services)-strlen(h->services)-1);
+}
+
+static void banner_connected(netmapper_scan *scan, int ci) {
+    conn_entry *c = &scan->conns[ci];
+    int port = scan->ports[c->port_idx];
+    if (is_http_port(port)) {
+        static const char req[] = "HEAD / HTTP/1.0\r\n\r\n";
+        if (send(c->fd, req, sizeof(req) - 1, MSG_NOSIGNAL) < 0) {
+            release_conn(scan, ci, CONN_CLOSED);
+            return;
+        }
+    }
+    c->reading = 1;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = ((uint64_t)EV_CONN << 32) | (uint32_t)ci;
+    if (epoll_ctl(scan->epfd, EPOLL_CTL_MOD, c->fd, &ev) != 0 &&
+        epoll_ctl(scan->epfd, EPOLL_CTL_ADD, c->fd, &ev) != 0) {
+        release_conn(scan, ci, CONN_CLOSED);
+    }
+}
+
+static void banner_readable(netmapper_scan *scan, int ci) {
+    conn_entry *c = &scan->conns[ci];
+    char buf[256];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+    if (n > 0) record_banner(scan, c->slot, scan->ports[c->port_idx], buf, n);
+    release_conn(scan, ci, CONN_OPEN);
+}
+
+static void start_service(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    int grabbed = 0;
+    s->phase = PH_SERVICE;
+    /* Held until every connection is launched so an early failure cannot end the stage. */
+    s->services_pending = 1;
+    for (size_t p = 0; p < scan->nports && grabbed < NM_BANNER_PORTS; p++) {
+        if (!s->open[p]) continue;
+        grabbed++;
+        int ci = alloc_conn(scan, i, (int)p, CONN_BANNER, long_timeout_ms(scan));
+        if (ci < 0) continue;
+        s->services_pending++;
+        int rc = scan->conns[ci].connect_rc;
+        if (rc == 0) {
+            banner_connected(scan, ci);
+        } else if (rc != EINPROGRESS || add_watch(scan, scan->conns[ci].fd, EPOLLOUT, EV_CONN, ci) != 0) {
+            release_conn(scan, ci, CONN_CLOSED);
+        }
+    }
+    if (--s->services_pending == 0) service_done(scan, i);
+}
+
+/* ---------------- UDP probes (sendmmsg/recvmmsg) ---------------- */
+
+static int open_udp_socket(void) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (fd < 0) return -1;
+    int on = 1;
+    int bufsz = 1 << 20;
+    /* ICMP port-unreachable on an unconnected socket is only reported through the error queue. */
+    if (setsockopt(fd, SOL_IP, IP_RECVERR, &on, sizeof(on)) != 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+    return fd;
+}
+
+static const udp_payload *find_udp_payload(int port) {
+    for (size_t k = 0; k < sizeof(udp_payloads)/sizeof(udp_payloads[0]); k++) {
+        if (udp_payloads[k].port == port) return &udp_payloads[k];
+    }
+    return NULL;
+}
+
+static void udp_link_tx(udp_batch *b, int k) {
+    memset(&b->tx[k], 0, sizeof(b->tx[k]));
+    b->tx[k].msg_hdr.msg_name = &b->tx_addr[k];
+    b->tx[k].msg_hdr.msg_namelen = sizeof(b->tx_addr[k]);
+    b->tx[k].msg_hdr.msg_iov = &b->tx_iov[k];
+    b->tx[k].msg_hdr.msg_iovlen = 1;
+}
+
+static void udp_fill_tx(netmapper_scan *scan, int k, int i, int udp_idx) {
+    udp_batch *b = scan->udp;
+    int port = scan->udp_ports[udp_idx];
+    const udp_payload *pl = find_udp_payload(port);
+    memset(&b->tx_addr[k], 0, sizeof(b->tx_addr[k]));
+    b->tx_addr[k].sin_family = AF_INET;
+    b->tx_addr[k].sin_port = htons(port);
+    b->tx_addr[k].sin_addr.s_addr = htonl(scan->slots[i].addr);
+    b->tx_iov[k].iov_base = pl ? (void*)pl->data : NULL;
+    b->tx_iov[k].iov_len = pl ? pl->len : 0;
+    udp_link_tx(b, k);
+    b->tx_slot[k] = i;
+    b->tx_udp_idx[k] = udp_idx;
+}
+
+static void udp_check_done(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    if (!s->udp_branch || s->next_udp < scan->nudp || s->udp_outstanding > 0) return;
+    s->udp_branch = 0;
+    maybe_finish(scan, i);
+}
+
+static void udp_mark(netmapper_scan *scan, int i, int udp_idx, int state) {
+    host_slot *s = &scan->slots[i];
+    if (!s->udp_branch || s->udp_state[udp_idx] != UDP_UNKNOWN) return;
+    s->udp_state[udp_idx] = state;
+    if (s->udp_outstanding > 0) {
+        s->udp_outstanding--;
+        scan->udp_in_flight--;
+    }
+    if (state == UDP_OPEN || state == UDP_CLOSED) mark_alive(scan, i);
+    udp_check_done(scan, i);
+}
+
+static void udp_flush(netmapper_scan *scan) {
+    udp_batch *b = scan->udp;
+    int off = 0;
+    while (off < b->tx_count) {
+        int n = nm_send_batch(scan->udpfd, b->tx + off, b->tx_count - off);
+        if (n == 0) break;
+        if (n < 0) {
+            host_slot *s = &scan->slots[b->tx_slot[off]];
+            if (s->addr == ntohl(b->tx_addr[off].sin_addr.s_addr)) udp_mark(scan, b->tx_slot[off], b->tx_udp_idx[off], UDP_FILTERED);
+            off++;
+            continue;
+        }
+        uint64_t deadline = nm_now_ms() + scan->timeout_ms;
+        for (int k = off; k < off + n; k++) {
+            host_slot *s = &scan->slots[b->tx_slot[k]];
+            if (s->udp_branch && s->addr == ntohl(b->tx_addr[k].sin_addr.s_addr)) s->udp_deadline = deadline;
+        }
+        off += n;
+    }
+    int left = b->tx_count - off;
+    for (int k = 0; k < left && off > 0; k++) {
+        b->tx_addr[k] = b->tx_addr[off + k];
+        b->tx_iov[k] = b->tx_iov[off + k];
+        b->tx_slot[k] = b->tx_slot[off + k];
+        b->tx_udp_idx[k] = b->tx_udp_idx[off + k];
+        udp_link_tx(b, k);
+    }
+    b->tx_count = left;
+}
+
+/* Returns -1 when the batch is still full after a flush (send buffer full); the probe is not queued. */
+static int udp_queue_probe(netmapper_scan *scan, int i, int udp_idx) {
+    udp_batch *b = scan->udp;
+    host_slot *s = &scan->slots[i];
+    if (b->tx_count == NM_UDP_BATCH) udp_flush(scan);
+    if (b->tx_count == NM_UDP_BATCH) return -1;
+    udp_fill_tx(scan, b->tx_count++, i, udp_idx);
+    s->udp_outstanding++;
+    scan->udp_in_flight++;
+    s->udp_deadline = nm_now_ms() + scan->timeout_ms;
+    return 0;
+}
+
+static void udp_setup_rx(udp_batch *b) {
+    for (int k = 0; k < NM_UDP_BATCH; k++) {
+        b->rx_iov[k].iov_base = b->rx_buf[k];
+        b->rx_iov[k].iov_len = NM_UDP_BUFSZ;
+        memset(&b->rx[k], 0, sizeof(b->rx[k]));
+        b->rx[k].msg_hdr.msg_name = &b->rx_addr[k];
+        b->rx[k].msg_hdr.msg_namelen = sizeof(b->rx_addr[k]);
+        b->rx[k].msg_hdr.msg_iov = &b->rx_iov[k];
+        b->rx[k].msg_hdr.msg_iovlen = 1;
+        b->rx[k].msg_hdr.msg_control = b->rx_ctrl[k];
+        b->rx[k].msg_hdr.msg_controllen = sizeof(b->rx_ctrl[k]);
+    }
+}
+
+static void udp_classify_error(netmapper_scan *scan, struct msghdr *msg) {
+    struct sockaddr_in *dst = msg->msg_name;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+        struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+        if (ee->ee_origin != SO_EE_ORIGIN_ICMP || ee->ee_type != ICMP_DEST_UNREACH) continue;
+        int i = addr_map_get(scan, ntohl(dst->sin_addr.s_addr));
+        int u = scan->udp_port_index[ntohs(dst->sin_port)];
+        if (i < 0 || u < 0) continue;
+        udp_mark(scan, i, u, ee->ee_code == ICMP_PORT_UNREACH ? UDP_CLOSED : UDP_FILTERED);
+    }
+}
+
+static void handle_udp(netmapper_scan *scan) {
+    udp_batch *b = scan->udp;
+    for (int round = 0; round < 64; round++) {
+        udp_setup_rx(b);
+        int n = recvmmsg(scan->udpfd, b->rx, NM_UDP_BATCH, MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            continue;
+        }
+        for (int k = 0; k < n; k++) {
+            int i = addr_map_get(scan, ntohl(b->rx_addr[k].sin_addr.s_addr));
+            int u = scan->udp_port_index[ntohs(b->rx_addr[k].sin_port)];
+            if (i >= 0 && u >= 0) udp_mark(scan, i, u, UDP_OPEN);
+        }
+        if (n < NM_UDP_BATCH) break;
+    }
+    for (int round = 0; round < 64; round++) {
+        udp_setup_rx(b);
+        int n = recvmmsg(scan->udpfd, b->rx, NM_UDP_BATCH, MSG_ERRQUEUE | MSG_DONTWAIT, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            continue;
+        }
+        for (int k = 0; k < n; k++) udp_classify_error(scan, &b->rx[k].msg_hdr);
+        if (n < NM_UDP_BATCH) break;
+    }
+}
+
+static void start_discovery(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    stage_reserve(scan, i, NETMAPPER_STAGE_ENRICH);
+    stage_reserve(scan, i, NETMAPPER_STAGE_PORTS);
+    s->phase = PH_DISCOVERY;
+    if (scan->icmpfd < 0) {
+        /* No ICMP available: a TCP connect that completes or is refused, or any UDP answer, proves liveness. */
+        discovery_done(scan, i, -1);
+        return;
+    }
+    s->ping_deadline = nm_now_ms() + long_timeout_ms(scan);
+    if (send_echo(scan, i) != 0) discovery_done(scan, i, 0);
+}
+
+static void start_ports(netmapper_scan *scan, int i) {
+    host_slot *s = &scan->slots[i];
+    stage_reserve(scan, i, NETMAPPER_STAGE_SERVICE);
+    s->phase = PH_PORTS;
+    s->next_port = 0;
+    s->ports_pending = 0;
+    /* With TCP disabled there is nothing to connect; give the service seat back before the next host is taken. */
+    if (scan->nports == 0) ports_check_done(scan, i);
+}
+
+static void admit_targets(netmapper_scan *scan) {
+    stage_queue *st = &scan->stages[NETMAPPER_STAGE_DISCOVERY];
+    while (scan->next_target < scan->ntargets && scan->nfree_slots > 0 && stage_room(st)) {
+        int i = scan->free_slots[--scan->nfree_slots];
+        host_slot *s = &scan->slots[i];
+        uint32_t addr = scan->targets[scan->next_target++];
+        memset(&s->host, 0, sizeof(s->host));
+        memset(s->open, 0, scan->nports);
+        if (scan->nudp) memset(s->udp_state, UDP_UNKNOWN, scan->nudp);
+        s->addr = addr;
+        s->alive = 0;
+        s->seats = 0;
+        s->enrich = EN_NONE;
+        s->udp_branch = 0;
+        s->dns_pending = 0;
+        s->phase = PH_DISCOVERY_Q;
+        struct in_addr a;
+        a.s_addr = htonl(addr);
+        inet_ntop(AF_INET, &a, s->host.ip, sizeof(s->host.ip));
+        addr_map_put(scan, addr, i);
+        stage_push(scan, i, NETMAPPER_STAGE_DISCOVERY);
+    }
+}
+
+/* Downstream stages run first so the space they free is visible to the stages feeding them. */
+static void pump_pipeline(netmapper_scan *scan) {
+    stage_queue *disc = &scan->stages[NETMAPPER_STAGE_DISCOVERY];
+    stage_queue *enrich = &scan->stages[NETMAPPER_STAGE_ENRICH];
+    stage_queue *ports = &scan->stages[NETMAPPER_STAGE_PORTS];
+    stage_queue *service = &scan->stages[NETMAPPER_STAGE_SERVICE];
+    while (stage_can_run(service) && scan->nfree_conns >= NM_BANNER_PORTS) {
+        start_service(scan, stage_pop(scan, NETMAPPER_STAGE_SERVICE));
+    }
+    while (stage_can_run(enrich)) {
+        start_enrich(scan, stage_pop(scan, NETMAPPER_STAGE_ENRICH));
+    }
+    while (stage_can_run(ports) && stage_room(service)) {
+        start_ports(scan, stage_pop(scan, NETMAPPER_STAGE_PORTS));
+    }
+    for (int i = 0; i < scan->max_hosts && scan->nfree_conns > 0; i++) {
+        host_slot *s = &scan->slots[i];
+        while (s->phase == PH_PORTS && s->next_port < scan->nports && scan->nfree_conns > 0) {
+            launch_connect(scan, i, (int)s->next_port++);
+        }
+        ports_check_done(scan, i);
+    }
+    if (scan->udpfd >= 0) {
+        int full = 0;
+        for (int i = 0; i < scan->max_hosts && !full; i++) {
+            host_slot *s = &scan->slots[i];
+            while (s->udp_branch && s->next_udp < scan->nudp && scan->udp_in_flight < scan->udp_limit) {
+                if (udp_queue_probe(scan, i, (int)s->next_udp) != 0) {
+                    full = 1;
+                    break;
+                }
+                s->next_udp++;
+            }
+        }
+        udp_flush(scan);
+    }
+    while (stage_can_run(disc) && stage_room(ports) && stage_room(enrich)) {
+        start_discovery(scan, stage_pop(scan, NETMAPPER_STAGE_DISCOVERY));
+    }
+    admit_targets(scan);
+}
+
+static void handle_icmp(netmapper_scan *scan) {
+    uint8_t buf[1500];
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(scan->icmpfd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+        if (n < 0) break;
+        const uint8_t *p = buf;
+        if (scan->icmp_raw) {
+            if (n < (ssize_t)sizeof(struct iphdr)) continue;
+            size_t ihl = ((const struct iphdr*)buf)->ihl * 4;
+            if ((size_t)n < ihl + sizeof(struct icmphdr)) continue;
+            p += ihl;
+            n -= ihl;
+        }
+        if (n < (ssize_t)sizeof(struct icmphdr)) continue;
+        const struct icmphdr *icmp = (const struct icmphdr*)p;
+        if (icmp->type != ICMP_ECHOREPLY) continue;
+        if (scan->icmp_raw && ntohs(icmp->un.echo.id) != scan->echo_id) continue;
+        int i = ntohs(icmp->un.echo.sequence);
+        if (i >= scan->max_hosts) continue;
+        host_slot *s = &scan->slots[i];
+        if (s->phase != PH_DISCOVERY || s->addr != ntohl(from.sin_addr.s_addr)) continue;
+        discovery_done(scan, i, 1);
+    }
+}
+
+static void handle_dns(netmapper_scan *scan) {
+    uint8_t buf[1500];
+    for (;;) {
+        ssize_t n = recv(scan->dnsfd, buf, sizeof(buf), 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            continue;
+        }
+        if (n < 12) continue;
+        int i = (buf[0] << 8) | buf[1];
+        if (i >= scan->max_hosts) continue;
+        host_slot *s = &scan->slots[i];
+        if (s->enrich != EN_ACTIVE || !s->dns_pending) continue;
+        char expect[64];
+        ptr_name(s->addr, expect, sizeof(expect));
+        if (parse_ptr_reply(buf, n, expect, s->host.hostname, sizeof(s->host.hostname)) != 0) continue;
+        enrich_done(scan, i);
+    }
+}
+
+static void handle_conn(netmapper_scan *scan, int ci) {
+    conn_entry *c = &scan->conns[ci];
+    if (c->fd < 0) return;
+    if (c->reading) {
+        banner_readable(scan, ci);
+        return;
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    if (c->purpose == CONN_BANNER) {
+        if (err == 0) banner_connected(scan, ci);
+        else release_conn(scan, ci, CONN_CLOSED);
+        return;
+    }
+    if (err == 0) release_conn(scan, ci, CONN_OPEN);
+    else if (err == ECONNREFUSED) release_conn(scan, ci, CONN_REFUSED);
+    else release_conn(scan, ci, CONN_CLOSED);
+}
+
+static void handle_timeouts(netmapper_scan *scan) {
+    uint64_t now = nm_now_ms();
+    for (int ci = 0; ci < NM_MAX_SOCKETS; ci++) {
+        if (scan->conns[ci].fd >= 0 && now >= scan->conns[ci].deadline) release_conn(scan, ci, CONN_CLOSED);
+    }
+    for (int i = 0; i < scan->max_hosts; i++) {
+        host_slot *s = &scan->slots[i];
+        if (s->phase == PH_DISCOVERY && now >= s->ping_deadline) {
+            discovery_done(scan, i, 0);
+            continue;
+        }
+        if (s->enrich == EN_ACTIVE && s->dns_pending && now >= s->dns_deadline) {
+            enrich_done(scan, i);
+        }
+        /* Unanswered UDP probes stay UDP_UNKNOWN (open|filtered). */
+        if (s->udp_branch && s->next_udp >= scan->nudp && s->udp_outstanding > 0 && now >= s->udp_deadline) {
+            scan->udp_in_flight -= s->udp_outstanding;
+            s->udp_outstanding = 0;
+            udp_check_done(scan, i);
+        }
+    }
+}
+
+/* ---------------- Public API ---------------- */
+
+netmapper_scan *netmapper_scan_new(void) {
+    netmapper_scan *scan = malloc(sizeof(netmapper_scan));
+    if (!scan) return NULL;
+    memset(scan, 0, sizeof(netmapper_scan));
+    scan->timerfd = -1;
+    scan->icmpfd = -1;
+    scan->dnsfd = -1;
+    scan->udpfd = -1;
+    scan->timeout_ms = NM_DEFAULT_TIMEOUT_MS;
+    scan->max_hosts = NM_DEFAULT_MAX_HOSTS;
+    scan->udp_limit = NM_DEFAULT_UDP_LIMIT;
+    scan->echo_id = getpid() & 0xffff;
+    for (int st = 0; st < NETMAPPER_STAGE_COUNT; st++) {
+        scan->stages[st].limit = default_stage_limit[st];
+        scan->stages[st].cap = default_stage_queue[st];
+    }
+    scan->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (scan->epfd < 0) {
+        free(scan);
+        return NULL;
+    }
+    return scan;
+}
+
+static void close_sockets(netmapper_scan *scan) {
+    if (scan->conns) {
+        for (int ci = 0; ci < NM_MAX_SOCKETS; ci++) {
+            if (scan->conns[ci].fd >= 0) close(scan->conns[ci].fd);
+        }
+    }
+    if (scan->timerfd >= 0) close(scan->timerfd);
+    if (scan->icmpfd >= 0) close(scan->icmpfd);
+    if (scan->dnsfd >= 0) close(scan->dnsfd);
+    if (scan->udpfd >= 0) close(scan->udpfd);
+    scan->timerfd = scan->icmpfd = scan->dnsfd = scan->udpfd = -1;
+    if (scan->slots) {
+        for (int i = 0; i < scan->max_hosts; i++) {
+            free(scan->slots[i].open);
+            free(scan->slots[i].udp_state);
+        }
+    }
+    free(scan->udp);
+    free(scan->udp_port_index);
+    free(scan->addr_map);
+    scan->udp = NULL;
+    scan->udp_port_index = NULL;
+    scan->addr_map = NULL;
+    for (int st = 0; st < NETMAPPER_STAGE_COUNT; st++) {
+        free(scan->stages[st].ring);
+        scan->stages[st].ring = NULL;
+    }
+    free(scan->slots);
+    free(scan->free_slots);
+    free(scan->conns);
+    free(scan->free_conns);
+    scan->slots = NULL;
+    scan->free_slots = NULL;
+    scan->conns = NULL;
+    scan->free_conns = NULL;
+}
+
+void netmapper_scan_free(netmapper_scan *scan) {
+    if (!scan) return;
+    close_sockets(scan);
+    close(scan->epfd);
+    free(scan->targets);
+    free(scan->ports);
+    free(scan->udp_ports);
+    free(scan);
+}
+
+void netmapper_set_timeout(netmapper_scan *scan, int timeout_ms) {
+    scan->timeout_ms = timeout_ms > 0 ? timeout_ms : NM_DEFAULT_TIMEOUT_MS;
+}
+
+void netmapper_set_concurrency(netmapper_scan *scan, int max_hosts) {
+    if (scan->running) return;
+    if (max_hosts < 1) max_hosts = 1;
+    if (max_hosts > 65535) max_hosts = 65535;
+    scan->max_hosts = max_hosts;
+}
+
+void netmapper_set_tcp_enabled(netmapper_scan *scan, int enabled) {
+    if (scan->running) return;
+    scan->tcp_disabled = !enabled;
+}
+
+void netmapper_set_udp_limit(netmapper_scan *scan, int probes) {
+    if (scan->running) return;
+    if (probes < 1) probes = 1;
+    scan->udp_limit = probes;
+}
+
+int netmapper_set_stage_limits(netmapper_scan *scan, netmapper_stage stage, int concurrency, int queue_capacity) {
+    if (scan->running || stage < 0 || stage >= NETMAPPER_STAGE_COUNT) return -1;
+    if (concurrency < 1 || queue_capacity < 1) return -1;
+    scan->stages[stage].limit = concurrency;
+    scan->stages[stage].cap = queue_capacity;
+    return 0;
+}
+
+void netmapper_set_callback(netmapper_scan *scan, netmapper_result_cb cb, void *user_data) {
+    scan->cb = cb;
+    scan->user_data = user_data;
+}
+
+int netmapper_add_range(netmapper_scan *scan, uint32_t start, uint32_t end) {
+    if (end < start) return -1;
+    size_t count = (size_t)(end - start) + 1;
+    if (scan->ntargets + count > scan->cap_targets) {
+        size_t cap = scan->cap_targets ? scan->cap_targets : 256;
+        while (cap < scan->ntargets + count) cap *= 2;
+        uint32_t *t = realloc(scan->targets, cap * sizeof(uint32_t));
+        if (!t) return -1;
+        scan->targets = t;
+        scan->cap_targets = cap;
+    }
+    for (size_t i = 0; i < count; i++) scan->targets[scan->ntargets++] = start + (uint32_t)i;
+    return 0;
+}
+
+int netmapper_add_target(netmapper_scan *scan, const char *ip) {
+    struct in_addr a;
+    if (inet_pton(AF_INET, ip, &a) != 1) return -1;
+    return netmapper_add_range(scan, ntohl(a.s_addr), ntohl(a.s_addr));
+}
+
+int netmapper_add_port(netmapper_scan *scan, int port) {
+    if (port < 1 || port > 65535) return -1;
+    if (scan->running) return -1;
+    if (scan->nports == scan->cap_ports) {
+        size_t cap = scan->cap_ports ? scan->cap_ports * 2 : 16;
+        int *p = realloc(scan->ports, cap * sizeof(int));
+        if (!p) return -1;
+        scan->ports = p;
+        scan->cap_ports = cap;
+    }
+    scan->ports[scan->nports++] = port;
+    return 0;
+}
+
+int netmapper_add_udp_port(netmapper_scan *scan, int port) {
+    if (port < 1 || port > 65535) return -1;
+    if (scan->running) return -1;
+    for (size_t u = 0; u < scan->nudp; u++) {
+        if (scan->udp_ports[u] == port) return 0;
+    }
+    if (scan->nudp == scan->cap_udp) {
+        size_t cap = scan->cap_udp ? scan->cap_udp * 2 : 16;
+        int *p = realloc(scan->udp_ports, cap * sizeof(int));
+        if (!p) return -1;
+        scan->udp_ports = p;
+        scan->cap_udp = cap;
+    }
+    scan->udp_ports[scan->nudp++] = port;
+    return 0;
+}
+
+int netmapper_add_default_udp_ports(netmapper_scan *scan) {
+    for (size_t i = 0; i < sizeof(default_udp_ports)/sizeof(int); i++) {
+        if (netmapper_add_udp_port(scan, default_udp_ports[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+static int setup_udp(netmapper_scan *scan) {
+    size_t cap = 16;
+    while (cap < (size_t)scan->max_hosts * 2) cap *= 2;
+    scan->addr_map = malloc(cap * sizeof(addr_entry));
+    scan->udp_port_index = malloc(65536 * sizeof(int));
+    scan->udp = malloc(sizeof(udp_batch));
+    if (!scan->addr_map || !scan->udp_port_index || !scan->udp) return -1;
+    for (size_t k = 0; k < cap; k++) scan->addr_map[k].slot = -1;
+    scan->addr_map_mask = cap - 1;
+    for (int p = 0; p < 65536; p++) scan->udp_port_index[p] = -1;
+    for (size_t u = 0; u < scan->nudp; u++) scan->udp_port_index[scan->udp_ports[u]] = (int)u;
+    scan->udp->tx_count = 0;
+    for (int i = 0; i < scan->max_hosts; i++) {
+        scan->slots[i].udp_state = calloc(scan->nudp, 1);
+        if (!scan->slots[i].udp_state) return -1;
+    }
+    scan->udpfd = open_udp_socket();
+    if (scan->udpfd < 0) return -1;
+    return add_watch(scan, scan->udpfd, EPOLLIN, EV_UDP, 0);
+}
+
+int netmapper_start(netmapper_scan *scan) {
+    if (scan->running) return -1;
+    close_sockets(scan);
+    if (scan->tcp_disabled) {
+        scan->nports = 0;
+    } else if (scan->nports == 0) {
+        for (size_t i = 0; i < sizeof(default_ports)/sizeof(int); i++) {
+            if (netmapper_add_port(scan, default_ports[i]) != 0) return -1;
+        }
+    }
+    scan->slots = calloc(scan->max_hosts, sizeof(host_slot));
+    scan->free_slots = calloc(scan->max_hosts, sizeof(int));
+    scan->conns = calloc(NM_MAX_SOCKETS, sizeof(conn_entry));
+    scan->free_conns = calloc(NM_MAX_SOCKETS, sizeof(int));
+    if (!scan->slots || !scan->free_slots || !scan->conns || !scan->free_conns) goto fail;
+    for (int i = 0; i < scan->max_hosts; i++) {
+        scan->slots[i].open = calloc(scan->nports ? scan->nports : 1, 1);
+        if (!scan->slots[i].open) goto fail;
+        scan->free_slots[i] = scan->max_hosts - 1 - i;
+    }
+    scan->nfree_slots = scan->max_hosts;
+    scan->udp_in_flight = 0;
+    for (int st = 0; st < NETMAPPER_STAGE_COUNT; st++) {
+        stage_queue *q = &scan->stages[st];
+        q->ring = calloc(q->cap, sizeof(int));
+        if (!q->ring) goto fail;
+        q->head = q->len = q->reserved = q->in_flight = 0;
+        q->peak = q->completed = 0;
+    }
+    for (int ci = 0; ci < NM_MAX_SOCKETS; ci++) {
+        scan->conns[ci].fd = -1;
+        scan->free_conns[ci] = NM_MAX_SOCKETS - 1 - ci;
+    }
+    scan->nfree_conns = NM_MAX_SOCKETS;
+    int tick = scan->timeout_ms / 4;
+    if (tick < 5) tick = 5;
+    if (tick > 50) tick = 50;
+    scan->timerfd = nm_open_ticker(tick);
+    if (scan->timerfd < 0 || add_watch(scan, scan->timerfd, EPOLLIN, EV_TIMER, 0) != 0) goto fail;
+    scan->icmpfd = open_icmp_socket(scan);
+    if (scan->icmpfd >= 0 && add_watch(scan, scan->icmpfd, EPOLLIN, EV_ICMP, 0) != 0) {
+        close(scan->icmpfd);
+        scan->icmpfd = -1;
+    }
+    if (scan->nudp > 0 && setup_udp(scan) != 0) goto fail;
+    scan->dnsfd = open_dns_socket();
+    if (scan->dnsfd >= 0 && add_watch(scan, scan->dnsfd, EPOLLIN, EV_DNS, 0) != 0) {
+        close(scan->dnsfd);
+        scan->dnsfd = -1;
+    }
+    scan->next_target = 0;
+    scan->completed = 0;
+    scan->running = 1;
+    pump_pipeline(scan);
+    return 0;
+fail:
+    close_sockets(scan);
+    return -1;
+}
+
+int netmapper_get_fd(const netmapper_scan *scan) {
+    return scan->epfd;
+}
+
+int netmapper_process(netmapper_scan *scan) {
+    if (!scan->running) return 0;
+    struct epoll_event evs[NM_MAX_EVENTS];
+    int n = epoll_wait(scan->epfd, evs, NM_MAX_EVENTS, 0);
+    if (n < 0 && errno != EINTR) return -1;
+    for (int k = 0; k < n; k++) {
+        int kind = (int)(evs[k].data.u64 >> 32);
+        int idx = (int)(evs[k].data.u64 & 0xffffffff);
+        if (kind == EV_TIMER) {
+            uint64_t expirations;
+            while (read(scan->timerfd, &expirations, sizeof(expirations)) > 0) {}
+            handle_timeouts(scan);
+        } else if (kind == EV_ICMP) {
+            handle_icmp(scan);
+        } else if (kind == EV_DNS) {
+            handle_dns(scan);
+        } else if (kind == EV_CONN) {
+            handle_conn(scan, idx);
+        } else if (kind == EV_UDP) {
+            handle_udp(scan);
+        }
+    }
+    pump_pipeline(scan);
+    if (scan->next_target >= scan->ntargets && scan->nfree_slots == scan->max_hosts) {
+        scan->running = 0;
+        close_sockets(scan);
+        return 0;
+    }
+    return 1;
+}
+
+void netmapper_get_progress(const netmapper_scan *scan, uint32_t *completed, uint32_t *total) {
+    if (completed) *completed = scan->completed;
+    if (total) *total = (uint32_t)scan->ntargets;
+}
+
+int netmapper_get_stage_stats(const netmapper_scan *scan, netmapper_stage stage, netmapper_stage_stats *out) {
+    if (stage < 0 || stage >= NETMAPPER_STAGE_COUNT || !out) return -1;
+    const stage_queue *q = &scan->stages[stage];
+    out->queued = q->len;
+    out->queue_capacity = q->cap;
+    out->peak_queued = q->peak;
+    out->in_flight = q->in_flight;
+    out->limit = q->limit;
+    out->completed = q->completed;
+    return 0;
+}
@@ -0,0 +1,140 @@
+#ifndef NETMAPPER_H
+#define NETMAPPER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * libnetmapper - the NetMapper scan engine.
+ *
+ * The engine owns no threads. All sockets and timers are multiplexed behind a
+ * single pollable fd (netmapper_get_fd); whenever it becomes readable the host
+ * calls netmapper_process(), which never blocks. Results are delivered through
+ * the registered callback from inside netmapper_process().
+ */
+
+typedef struct netmapper_scan netmapper_scan;
+
+typedef struct {
+    char ip[64];
+    char status[16];
+    char hostname[256];
+    char mac[32];
+    char ports[256];
+    char udp_ports[256];
+    char services[512];
+} netmapper_host;
+
+/*
+ * The scan is a pipeline of stages joined by bounded queues. A live host goes
+ * through discovery, then ports, then service probing. Enrichment (MAC and
+ * hostname) runs alongside the port scan. A stage only takes a host on when
+ * every queue it may hand that host to has a free seat, so a slow stage
+ * throttles the stages feeding it instead of letting queues grow.
+ */
+typedef enum {
+    NETMAPPER_STAGE_DISCOVERY,
+    NETMAPPER_STAGE_ENRICH,
+    NETMAPPER_STAGE_PORTS,
+    NETMAPPER_STAGE_SERVICE,
+    NETMAPPER_STAGE_COUNT
+} netmapper_stage;
+
+typedef struct {
+    uint32_t queued;
+    uint32_t queue_capacity;
+    uint32_t peak_queued;
+    uint32_t in_flight;
+    uint32_t limit;
+    uint32_t completed;
+} netmapper_stage_stats;
+
+typedef void (*netmapper_result_cb)(const netmapper_host *host, void *user_data);
+
+/* Primary non-loopback IPv4 network; start/end are usable host addresses in host byte order. */
+int netmapper_detect_network(uint32_t *start, uint32_t *end, char *netstr, size_t netsz);
+
+netmapper_scan *netmapper_scan_new(void);
+void netmapper_scan_free(netmapper_scan *scan);
+
+void netmapper_set_timeout(netmapper_scan *scan, int timeout_ms);
+/* Hosts held anywhere in the pipeline at once. */
+void netmapper_set_concurrency(netmapper_scan *scan, int max_hosts);
+/* Hosts a stage works on at once, and how many may wait in its input queue. */
+int netmapper_set_stage_limits(netmapper_scan *scan, netmapper_stage stage, int concurrency, int queue_capacity);
+void netmapper_set_callback(netmapper_scan *scan, netmapper_result_cb cb, void *user_data);
+
+int netmapper_add_target(netmapper_scan *scan, const char *ip);
+int netmapper_add_range(netmapper_scan *scan, uint32_t start, uint32_t end);
+/* TCP port to check; when none are added a default list of common ports is used. */
+int netmapper_add_port(netmapper_scan *scan, int port);
+/* Turns the TCP port scan (and with it service probing) off or on; on by default. */
+void netmapper_set_tcp_enabled(netmapper_scan *scan, int enabled);
+/*
+ * UDP port to probe. Probes are batched with sendmmsg() and answered with recvmmsg();
+ * a reply marks the port open, ICMP port-unreachable marks it closed. No UDP ports
+ * are probed unless added.
+ */
+int netmapper_add_udp_port(netmapper_scan *scan, int port);
+/*
+ * UDP probes awaiting an answer at once, across all hosts (default 4096). UDP
+ * probing starts when discovery ends, but a host keeps its slot until its TCP
+ * ports are done too. With filtered TCP ports the TCP socket pool limits the
+ * rate; disable TCP for fast UDP sweeps.
+ */
+void netmapper_set_udp_limit(netmapper_scan *scan, int probes);
+/* DNS 53, NTP 123, NetBIOS 137, SNMP 161, SSDP 1900 and mDNS 5353, each with a protocol-specific payload. */
+int netmapper_add_default_udp_ports(netmapper_scan *scan);
+
+int netmapper_start(netmapper_scan *scan);
+int netmapper_get_fd(const netmapper_scan *scan);
+/* Handles whatever is ready. Returns 1 while the scan is running, 0 once finished, -1 on error. */
+int netmapper_process(netmapper_scan *scan);
+void netmapper_get_progress(const netmapper_scan *scan, uint32_t *completed, uint32_t *total);
+int netmapper_get_stage_stats(const netmapper_scan *scan, netmapper_stage stage, netmapper_stage_stats *out);
+
+/*
+ * Topology mapping. UDP probes go out to every destination at every hop
+ * count at once, paced to a probe rate, from a single socket. Each
+ * destination keeps one flow identifier so load-balanced paths stay stable.
+ * ICMP time-exceeded replies are collected asynchronously. Hops that went
+ * unanswered are probed again for a configurable number of extra rounds.
+ * Shared hops are merged into a router graph that ends in the /24 subnets
+ * of the destinations. A hop that never answered becomes an anonymous
+ * placeholder node instead of an edge across the gap. A raw ICMP socket is
+ * used when available; otherwise replies are read from the UDP socket's
+ * error queue.
+ */
+typedef struct netmapper_topo netmapper_topo;
+
+netmapper_topo *netmapper_topo_new(void);
+void netmapper_topo_free(netmapper_topo *topo);
+
+void netmapper_topo_set_max_ttl(netmapper_topo *topo, int max_ttl);
+void netmapper_topo_set_rate(netmapper_topo *topo, int probes_per_sec);
+/* How long to wait for replies after the last probe of a round. */
+void netmapper_topo_set_timeout(netmapper_topo *topo, int timeout_ms);
+void netmapper_topo_set_retries(netmapper_topo *topo, int retries);
+
+int netmapper_topo_add_target(netmapper_topo *topo, const char *ip);
+int netmapper_topo_add_range(netmapper_topo *topo, uint32_t start, uint32_t end);
+
+int netmapper_topo_start(netmapper_topo *topo);
+int netmapper_topo_get_fd(const netmapper_topo *topo);
+/* Same contract as netmapper_process(). */
+int netmapper_topo_process(netmapper_topo *topo);
+void netmapper_topo_get_progress(const netmapper_topo *topo, uint32_t *probes_sent, uint32_t *replies);
+
+int netmapper_topo_export_dot(const netmapper_topo *topo, FILE *out);
+int netmapper_topo_export_json(const netmapper_topo *topo, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
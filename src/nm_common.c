@@ -0,0 +1,49 @@
+#define _GNU_SOURCE
+#include "nm_common.h"
+
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+#define NM_SEND_RETRIES 4
+
+uint64_t nm_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int nm_add_watch(int epfd, int fd, uint32_t events, uint64_t data) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = data;
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int nm_open_ticker(int tick_ms) {
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) return -1;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_nsec = tick_ms * 1000000L;
+    its.it_interval.tv_nsec = tick_ms * 1000000L;
+    if (timerfd_settime(fd, 0, &its, NULL) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int nm_send_batch(int fd, struct mmsghdr *msgs, int count) {
+    for (int tries = 0; tries <= NM_SEND_RETRIES; tries++) {
+        int n = sendmmsg(fd, msgs, count, 0);
+        if (n > 0) return n;
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) return 0;
+        /* A queued ICMP error is reported by the next send and that datagram is not sent; retry it. */
+    }
+    return -1;
+}
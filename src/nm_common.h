@@ -0,0 +1,31 @@
+#ifndef NM_COMMON_H
+#define NM_COMMON_H
+
+/* Helpers shared by the scan engine and the topology mapper; not part of the public API. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+uint64_t nm_now_ms(void);
+int nm_add_watch(int epfd, int fd, uint32_t events, uint64_t data);
+/* Non-blocking periodic timerfd; -1 on error. */
+int nm_open_ticker(int tick_ms);
+
+/* Mix the high bits down so addresses like 10.b.c.1 spread over the table. */
+static inline size_t nm_addr_hash(uint32_t addr, size_t mask) {
+    uint32_t h = addr * 2654435761u;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h & mask;
+}
+
+/*
+ * One sendmmsg() step over msgs[0..count). Returns the number of datagrams
+ * sent, 0 when the socket buffer is full, or -1 when msgs[0] keeps failing
+ * and should be dropped by the caller.
+ */
+int nm_send_batch(int fd, struct mmsghdr *msgs, int count);
+
+#endif
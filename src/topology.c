@@ -0,0 +1,678 @@
+#define _GNU_SOURCE
+#include "netmapper.h"
+#include "nm_common.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <linux/errqueue.h>
+
+#define NM_TOPO_DEFAULT_MAX_TTL 16
+#define NM_TOPO_MAX_TTL 32
+#define NM_TOPO_DEFAULT_RATE 20000
+#define NM_TOPO_DEFAULT_TIMEOUT_MS 1000
+#define NM_TOPO_DEFAULT_RETRIES 2
+#define NM_TOPO_DPORT 33434
+#define NM_TOPO_BATCH 64
+#define NM_TOPO_TICK_MS 10
+#define NM_TOPO_SUBNET_MASK 0xffffff00u
+
+enum { TEV_TIMER = 1, TEV_ICMP, TEV_UDP };
+enum { NODE_LOCAL, NODE_ROUTER, NODE_SUBNET, NODE_ANON };
+
+typedef struct {
+    uint32_t addr;
+    int reached_ttl;
+    int unreach_ttl;
+    int unreach_code;
+    uint32_t hops[NM_TOPO_MAX_TTL + 1];
+} topo_dest;
+
+typedef struct {
+    uint64_t from;
+    uint64_t to;
+} topo_edge;
+
+struct netmapper_topo {
+    int epfd;
+    int timerfd;
+    int icmpfd;
+    int udpfd;
+    uint16_t sport;
+    int max_ttl;
+    int rate;
+    int timeout_ms;
+    int retries;
+    topo_dest *dests;
+    size_t ndests;
+    size_t cap_dests;
+    int *dest_map;
+    size_t dest_map_mask;
+    int round;
+    size_t cur_dest;
+    int cur_ttl;
+    uint64_t round_end;
+    uint64_t last_refill;
+    double tokens;
+    struct mmsghdr tx[NM_TOPO_BATCH];
+    struct iovec tx_iov[NM_TOPO_BATCH];
+    struct sockaddr_in tx_addr[NM_TOPO_BATCH];
+    uint8_t tx_ctrl[NM_TOPO_BATCH][CMSG_SPACE(sizeof(int))];
+    int tx_count;
+    uint8_t payload[NM_TOPO_MAX_TTL + 1][NM_TOPO_MAX_TTL];
+    uint32_t probes_sent;
+    uint32_t replies;
+    int running;
+};
+
+static int dest_lookup(const netmapper_topo *topo, uint32_t addr) {
+    size_t k = nm_addr_hash(addr, topo->dest_map_mask);
+    while (topo->dest_map[k] >= 0) {
+        if (topo->dests[topo->dest_map[k]].addr == addr) return topo->dest_map[k];
+        k = (k + 1) & topo->dest_map_mask;
+    }
+    return -1;
+}
+
+static int build_dest_map(netmapper_topo *topo) {
+    size_t cap = 16;
+    while (cap < topo->ndests * 2) cap *= 2;
+    free(topo->dest_map);
+    topo->dest_map = malloc(cap * sizeof(int));
+    if (!topo->dest_map) return -1;
+    for (size_t k = 0; k < cap; k++) topo->dest_map[k] = -1;
+    topo->dest_map_mask = cap - 1;
+    for (size_t d = 0; d < topo->ndests; d++) {
+        size_t k = nm_addr_hash(topo->dests[d].addr, topo->dest_map_mask);
+        while (topo->dest_map[k] >= 0) k = (k + 1) & topo->dest_map_mask;
+        topo->dest_map[k] = (int)d;
+    }
+    return 0;
+}
+
+/* ---------------- Probing ---------------- */
+
+/*
+ * Every probe to a destination shares one 5-tuple (fixed source port, fixed
+ * destination port), so per-flow load balancers keep all hop counts on the
+ * same path, as in Paris traceroute. The TTL is carried in the UDP length,
+ * which routers quote back in time-exceeded messages but do not hash on.
+ */
+static int probe_wanted(const netmapper_topo *topo, const topo_dest *d, int ttl) {
+    if (d->reached_ttl && ttl >= d->reached_ttl) return 0;
+    if (d->unreach_ttl && ttl >= d->unreach_ttl) return 0;
+    if (topo->round == 0) return 1;
+    return d->hops[ttl] == 0;
+}
+
+static int next_probe(netmapper_topo *topo, size_t *dest, int *ttl) {
+    while (topo->cur_dest < topo->ndests) {
+        topo_dest *d = &topo->dests[topo->cur_dest];
+        while (topo->cur_ttl <= topo->max_ttl) {
+            int t = topo->cur_ttl++;
+            if (probe_wanted(topo, d, t)) {
+                *dest = topo->cur_dest;
+                *ttl = t;
+                return 1;
+            }
+        }
+        topo->cur_dest++;
+        topo->cur_ttl = 1;
+    }
+    return 0;
+}
+
+static void fill_tx(netmapper_topo *topo, int k, size_t dest, int ttl) {
+    memset(&topo->tx_addr[k], 0, sizeof(topo->tx_addr[k]));
+    topo->tx_addr[k].sin_family = AF_INET;
+    topo->tx_addr[k].sin_port = htons(NM_TOPO_DPORT);
+    topo->tx_addr[k].sin_addr.s_addr = htonl(topo->dests[dest].addr);
+    topo->tx_iov[k].iov_base = topo->payload[ttl];
+    topo->tx_iov[k].iov_len = ttl;
+    memset(&topo->tx[k], 0, sizeof(topo->tx[k]));
+    struct msghdr *m = &topo->tx[k].msg_hdr;
+    m->msg_name = &topo->tx_addr[k];
+    m->msg_namelen = sizeof(topo->tx_addr[k]);
+    m->msg_iov = &topo->tx_iov[k];
+    m->msg_iovlen = 1;
+    m->msg_control = topo->tx_ctrl[k];
+    m->msg_controllen = sizeof(topo->tx_ctrl[k]);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(m);
+    cm->cmsg_level = SOL_IP;
+    cm->cmsg_type = IP_TTL;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &ttl, sizeof(int));
+}
+
+static int flush_tx(netmapper_topo *topo) {
+    int off = 0;
+    while (off < topo->tx_count) {
+        int n = nm_send_batch(topo->udpfd, topo->tx + off, topo->tx_count - off);
+        if (n == 0) break;
+        if (n < 0) {
+            off++;
+            continue;
+        }
+        off += n;
+        topo->probes_sent += n;
+    }
+    int left = topo->tx_count - off;
+    for (int k = 0; k < left && off > 0; k++) {
+        int ttl = (int)topo->tx_iov[off + k].iov_len;
+        uint32_t addr = ntohl(topo->tx_addr[off + k].sin_addr.s_addr);
+        fill_tx(topo, k, (size_t)dest_lookup(topo, addr), ttl);
+    }
+    topo->tx_count = left;
+    return left == 0 ? 0 : -1;
+}
+
+static void send_probes(netmapper_topo *topo) {
+    uint64_t now = nm_now_ms();
+    topo->tokens += (double)topo->rate * (now - topo->last_refill) / 1000.0;
+    if (topo->tokens > topo->rate / 10.0 + NM_TOPO_BATCH) topo->tokens = topo->rate / 10.0 + NM_TOPO_BATCH;
+    topo->last_refill = now;
+    if (topo->tx_count > 0 && flush_tx(topo) != 0) return;
+    size_t dest;
+    int ttl;
+    while (topo->tokens >= 1.0 && next_probe(topo, &dest, &ttl)) {
+        fill_tx(topo, topo->tx_count++, dest, ttl);
+        topo->tokens -= 1.0;
+        if (topo->tx_count == NM_TOPO_BATCH && flush_tx(topo) != 0) return;
+    }
+    if (topo->tx_count > 0) flush_tx(topo);
+}
+
+static int round_finished_sending(const netmapper_topo *topo) {
+    return topo->cur_dest >= topo->ndests && topo->tx_count == 0;
+}
+
+/* Hop of the router that reported the destination unreachable: it received the probe and could not forward it. */
+static int unreach_hop(const topo_dest *d) {
+    return d->unreach_ttl > 1 ? d->unreach_ttl - 1 : 1;
+}
+
+/*
+ * Time-exceeded names the router at that hop. Unreachable from the destination
+ * means it was reached; from any other router it ends the path at that router,
+ * which answers for every higher TTL too, so only the lowest one is kept.
+ */
+static void record_reply(netmapper_topo *topo, uint32_t router, uint32_t dst, int ttl, int type, int code) {
+    int d = dest_lookup(topo, dst);
+    if (d < 0 || ttl < 1 || ttl > topo->max_ttl) return;
+    topo_dest *td = &topo->dests[d];
+    topo->replies++;
+    if (type == ICMP_DEST_UNREACH && router == dst) {
+        if (!td->reached_ttl || ttl < td->reached_ttl) td->reached_ttl = ttl;
+        return;
+    }
+    if (type == ICMP_DEST_UNREACH) {
+        if (td->unreach_ttl && ttl >= td->unreach_ttl) return;
+        td->unreach_ttl = ttl;
+        td->unreach_code = code;
+        td->hops[unreach_hop(td)] = router;
+        return;
+    }
+    if (td->unreach_ttl && ttl >= td->unreach_ttl) return;
+    if (!td->hops[ttl]) td->hops[ttl] = router;
+}
+
+static void handle_icmp(netmapper_topo *topo) {
+    uint8_t buf[1500];
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t fromlen = sizeof(from);
+        ssize_t n = recvfrom(topo->icmpfd, buf, sizeof(buf), 0, (struct sockaddr*)&from, &fromlen);
+        if (n < 0) break;
+        if (n < (ssize_t)sizeof(struct iphdr)) continue;
+        size_t ihl = ((const struct iphdr*)buf)->ihl * 4;
+        if ((size_t)n < ihl + sizeof(struct icmphdr) + sizeof(struct iphdr)) continue;
+        const struct icmphdr *icmp = (const struct icmphdr*)(buf + ihl);
+        if (icmp->type != ICMP_TIME_EXCEEDED && icmp->type != ICMP_DEST_UNREACH) continue;
+        const uint8_t *inner = buf + ihl + sizeof(struct icmphdr);
+        const struct iphdr *iip = (const struct iphdr*)inner;
+        size_t iihl = iip->ihl * 4;
+        if (iip->protocol != IPPROTO_UDP) continue;
+        if ((size_t)n < ihl + sizeof(struct icmphdr) + iihl + sizeof(struct udphdr)) continue;
+        const struct udphdr *udp = (const struct udphdr*)(inner + iihl);
+        if (ntohs(udp->source) != topo->sport || ntohs(udp->dest) != NM_TOPO_DPORT) continue;
+        int ttl = ntohs(udp->len) - (int)sizeof(struct udphdr);
+        record_reply(topo, ntohl(from.sin_addr.s_addr), ntohl(iip->daddr), ttl, icmp->type, icmp->code);
+    }
+}
+
+/*
+ * Without a raw socket the TTL is recovered from the quoted payload, whose
+ * bytes all hold it. The error queue strips the quoted UDP header, so a
+ * router that quotes only those 8 bytes leaves nothing to match and its
+ * reply is dropped; the hop stays anonymous.
+ */
+static void handle_errqueue(netmapper_topo *topo) {
+    for (int round = 0; round < 1024; round++) {
+        uint8_t data[64];
+        uint8_t ctrl[512];
+        struct sockaddr_in dst;
+        struct iovec iov = { data, sizeof(data) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &dst;
+        msg.msg_namelen = sizeof(dst);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof(ctrl);
+        ssize_t n = recvmsg(topo->udpfd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            continue;
+        }
+        if (n < 1) continue;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) continue;
+            struct sock_extended_err *ee = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ICMP) continue;
+            struct sockaddr_in *offender = (struct sockaddr_in*)SO_EE_OFFENDER(ee);
+            if (offender->sin_family != AF_INET) continue;
+            record_reply(topo, ntohl(offender->sin_addr.s_addr), ntohl(dst.sin_addr.s_addr), data[0], ee->ee_type, ee->ee_code);
+        }
+    }
+    uint8_t scratch[64];
+    while (recv(topo->udpfd, scratch, sizeof(scratch), MSG_DONTWAIT) >= 0 || errno == ECONNREFUSED) {}
+}
+
+static int missing_probes(const netmapper_topo *topo) {
+    for (size_t d = 0; d < topo->ndests; d++) {
+        const topo_dest *td = &topo->dests[d];
+        int limit = td->reached_ttl ? td->reached_ttl - 1 : td->unreach_ttl ? unreach_hop(td) : topo->max_ttl;
+        for (int t = 1; t <= limit; t++) {
+            if (!td->hops[t]) return 1;
+        }
+    }
+    return 0;
+}
+
+static void close_sockets(netmapper_topo *topo) {
+    if (topo->timerfd >= 0) close(topo->timerfd);
+    if (topo->icmpfd >= 0) close(topo->icmpfd);
+    if (topo->udpfd >= 0) close(topo->udpfd);
+    topo->timerfd = topo->icmpfd = topo->udpfd = -1;
+}
+
+/* ---------------- Public API ---------------- */
+
+netmapper_topo *netmapper_topo_new(void) {
+    netmapper_topo *topo = malloc(sizeof(netmapper_topo));
+    if (!topo) return NULL;
+    memset(topo, 0, sizeof(netmapper_topo));
+    topo->timerfd = -1;
+    topo->icmpfd = -1;
+    topo->udpfd = -1;
+    topo->max_ttl = NM_TOPO_DEFAULT_MAX_TTL;
+    topo->rate = NM_TOPO_DEFAULT_RATE;
+    topo->timeout_ms = NM_TOPO_DEFAULT_TIMEOUT_MS;
+    topo->retries = NM_TOPO_DEFAULT_RETRIES;
+    for (int t = 0; t <= NM_TOPO_MAX_TTL; t++) memset(topo->payload[t], t, sizeof(topo->payload[t]));
+    topo->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (topo->epfd < 0) {
+        free(topo);
+        return NULL;
+    }
+    return topo;
+}
+
+void netmapper_topo_free(netmapper_topo *topo) {
+    if (!topo) return;
+    close_sockets(topo);
+    close(topo->epfd);
+    free(topo->dests);
+    free(topo->dest_map);
+    free(topo);
+}
+
+void netmapper_topo_set_max_ttl(netmapper_topo *topo, int max_ttl) {
+    if (max_ttl < 1) max_ttl = 1;
+    if (max_ttl > NM_TOPO_MAX_TTL) max_ttl = NM_TOPO_MAX_TTL;
+    topo->max_ttl = max_ttl;
+}
+
+void netmapper_topo_set_rate(netmapper_topo *topo, int probes_per_sec) {
+    topo->rate = probes_per_sec > 0 ? probes_per_sec : NM_TOPO_DEFAULT_RATE;
+}
+
+void netmapper_topo_set_timeout(netmapper_topo *topo, int timeout_ms) {
+    topo->timeout_ms = timeout_ms > 0 ? timeout_ms : NM_TOPO_DEFAULT_TIMEOUT_MS;
+}
+
+void netmapper_topo_set_retries(netmapper_topo *topo, int retries) {
+    topo->retries = retries >= 0 ? retries : 0;
+}
+
+int netmapper_topo_add_range(netmapper_topo *topo, uint32_t start, uint32_t end) {
+    if (end < start || topo->running) return -1;
+    size_t count = (size_t)(end - start) + 1;
+    if (topo->ndests + count > topo->cap_dests) {
+        size_t cap = topo->cap_dests ? topo->cap_dests : 256;
+        while (cap < topo->ndests + count) cap *= 2;
+        topo_dest *d = realloc(topo->dests, cap * sizeof(topo_dest));
+        if (!d) return -1;
+        topo->dests = d;
+        topo->cap_dests = cap;
+    }
+    for (size_t i = 0; i < count; i++) {
+        topo_dest *d = &topo->dests[topo->ndests++];
+        memset(d, 0, sizeof(*d));
+        d->addr = start + (uint32_t)i;
+    }
+    return 0;
+}
+
+int netmapper_topo_add_target(netmapper_topo *topo, const char *ip) {
+    struct in_addr a;
+    if (inet_pton(AF_INET, ip, &a) != 1) return -1;
+    return netmapper_topo_add_range(topo, ntohl(a.s_addr), ntohl(a.s_addr));
+}
+
+int netmapper_topo_start(netmapper_topo *topo) {
+    if (topo->running || topo->ndests == 0) return -1;
+    close_sockets(topo);
+    if (build_dest_map(topo) != 0) return -1;
+    for (size_t d = 0; d < topo->ndests; d++) {
+        topo->dests[d].reached_ttl = 0;
+        topo->dests[d].unreach_ttl = 0;
+        topo->dests[d].unreach_code = 0;
+        memset(topo->dests[d].hops, 0, sizeof(topo->dests[d].hops));
+    }
+    topo->udpfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (topo->udpfd < 0) goto fail;
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    socklen_t llen = sizeof(local);
+    int bufsz = 1 << 20;
+    setsockopt(topo->udpfd, SOL_SOCKET, SO_SNDBUF, &bufsz, sizeof(bufsz));
+    if (bind(topo->udpfd, (struct sockaddr*)&local, sizeof(local)) != 0) goto fail;
+    if (getsockname(topo->udpfd, (struct sockaddr*)&local, &llen) != 0) goto fail;
+    topo->sport = ntohs(local.sin_port);
+    topo->icmpfd = socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_ICMP);
+    if (topo->icmpfd >= 0) {
+        setsockopt(topo->icmpfd, SOL_SOCKET, SO_RCVBUF, &bufsz, sizeof(bufsz));
+        if (nm_add_watch(topo->epfd, topo->icmpfd, EPOLLIN, TEV_ICMP) != 0) goto fail;
+    } else {
+        int on = 1;
+        if (setsockopt(topo->udpfd, SOL_IP, IP_RECVERR, &on, sizeof(on)) != 0) goto fail;
+        if (nm_add_watch(topo->epfd, topo->udpfd, EPOLLIN, TEV_UDP) != 0) goto fail;
+    }
+    topo->timerfd = nm_open_ticker(NM_TOPO_TICK_MS);
+    if (topo->timerfd < 0 || nm_add_watch(topo->epfd, topo->timerfd, EPOLLIN, TEV_TIMER) != 0) goto fail;
+    topo->round = 0;
+    topo->cur_dest = 0;
+    topo->cur_ttl = 1;
+    topo->round_end = 0;
+    topo->tx_count = 0;
+    topo->probes_sent = 0;
+    topo->replies = 0;
+    topo->tokens = NM_TOPO_BATCH;
+    topo->last_refill = nm_now_ms();
+    topo->running = 1;
+    send_probes(topo);
+    return 0;
+fail:
+    close_sockets(topo);
+    return -1;
+}
+
+int netmapper_topo_get_fd(const netmapper_topo *topo) {
+    return topo->epfd;
+}
+
+int netmapper_topo_process(netmapper_topo *topo) {
+    if (!topo->running) return 0;
+    struct epoll_event evs[8];
+    int n = epoll_wait(topo->epfd, evs, 8, 0);
+    if (n < 0 && errno != EINTR) return -1;
+    for (int k = 0; k < n; k++) {
+        if (evs[k].data.u64 == TEV_TIMER) {
+            uint64_t expirations;
+            while (read(topo->timerfd, &expirations, sizeof(expirations)) > 0) {}
+        } else if (evs[k].data.u64 == TEV_ICMP) {
+            handle_icmp(topo);
+        } else if (evs[k].data.u64 == TEV_UDP) {
+            handle_errqueue(topo);
+        }
+    }
+    if (!round_finished_sending(topo)) {
+        send_probes(topo);
+        if (round_finished_sending(topo)) topo->round_end = nm_now_ms() + topo->timeout_ms;
+        return 1;
+    }
+    if (topo->round_end == 0) topo->round_end = nm_now_ms() + topo->timeout_ms;
+    if (nm_now_ms() < topo->round_end) return 1;
+    if (topo->round < topo->retries && missing_probes(topo)) {
+        topo->round++;
+        topo->cur_dest = 0;
+        topo->cur_ttl = 1;
+        topo->round_end = 0;
+        send_probes(topo);
+        return 1;
+    }
+    topo->running = 0;
+    close_sockets(topo);
+    return 0;
+}
+
+void netmapper_topo_get_progress(const netmapper_topo *topo, uint32_t *probes_sent, uint32_t *replies) {
+    if (probes_sent) *probes_sent = topo->probes_sent;
+    if (replies) *replies = topo->replies;
+}
+
+/* ---------------- Graph export ---------------- */
+
+static uint64_t node_id(int kind, uint32_t addr) {
+    return ((uint64_t)kind << 32) | addr;
+}
+
+static int edge_cmp(const void *a, const void *b) {
+    const topo_edge *x = a, *y = b;
+    if (x->from != y->from) return x->from < y->from ? -1 : 1;
+    if (x->to != y->to) return x->to < y->to ? -1 : 1;
+    return 0;
+}
+
+static void node_name(uint64_t id, char *out, size_t outsz) {
+    int kind = (int)(id >> 32);
+    struct in_addr a;
+    a.s_addr = htonl((uint32_t)id);
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &a, ip, sizeof(ip));
+    if (kind == NODE_LOCAL) snprintf(out, outsz, "local");
+    else if (kind == NODE_SUBNET) snprintf(out, outsz, "%s/24", ip);
+    else if (kind == NODE_ANON) snprintf(out, outsz, "anon-%08x", (uint32_t)id);
+    else snprintf(out, outsz, "%s", ip);
+}
+
+/* Hop count at which a router shows up a second time (a forwarding loop), or 0. */
+static int path_loop(const netmapper_topo *topo, const topo_dest *d) {
+    int limit = d->reached_ttl ? d->reached_ttl - 1 : d->unreach_ttl ? unreach_hop(d) : topo->max_ttl;
+    for (int t = 2; t <= limit; t++) {
+        if (!d->hops[t]) continue;
+        for (int u = 1; u < t; u++) {
+            if (d->hops[u] == d->hops[t]) return t;
+        }
+    }
+    return 0;
+}
+
+/* The destination answered and the path to it has no loop. */
+static int path_complete(const netmapper_topo *topo, const topo_dest *d) {
+    return d->reached_ttl && !path_loop(topo, d);
+}
+
+/* A router other than the destination reported it unreachable, ending the path there. */
+static int path_unreachable(const netmapper_topo *topo, const topo_dest *d) {
+    return !d->reached_ttl && d->unreach_ttl && !path_loop(topo, d);
+}
+
+/*
+ * Hops before the destination, up to the router that reported it unreachable,
+ * or up to the last router that answered when the path is incomplete.
+ */
+static int path_len(const netmapper_topo *topo, const topo_dest *d) {
+    if (path_complete(topo, d)) return d->reached_ttl - 1;
+    if (path_unreachable(topo, d)) return unreach_hop(d);
+    int loop = path_loop(topo, d);
+    int last = loop ? loop - 1 : topo->max_ttl;
+    while (last > 0 && !d->hops[last]) last--;
+    return last;
+}
+
+/* The last-hop router answers host-unreachable for a dead host on its own subnet. */
+static int behind_unreach_router(const netmapper_topo *topo, const topo_dest *d) {
+    return path_unreachable(topo, d) && d->unreach_code == ICMP_HOST_UNREACH;
+}
+
+/* Router on the hop just before the destination; 0 when that hop is unknown or the destination is adjacent. */
+static uint32_t dest_gateway(const netmapper_topo *topo, const topo_dest *d) {
+    if (behind_unreach_router(topo, d)) return d->hops[unreach_hop(d)];
+    if (!path_complete(topo, d) || d->reached_ttl < 2) return 0;
+    uint32_t gw = d->hops[d->reached_ttl - 1];
+    return gw != d->addr ? gw : 0;
+}
+
+/*
+ * Placeholder for a hop that never answered, keyed by the known nodes around
+ * the gap and its position in it, so paths through the same gap share it.
+ */
+static uint64_t anon_id(uint64_t before, uint64_t after, int offset) {
+    uint64_t h = before * 0x9e3779b97f4a7c15ull ^ after;
+    h = (h ^ (h >> 29)) * 0xbf58476d1ce4e5b9ull ^ (uint64_t)offset;
+    h ^= h >> 32;
+    return node_id(NODE_ANON, (uint32_t)h);
+}
+
+/* Router-to-router and router-to-subnet links, sorted and deduplicated across all paths. */
+static topo_edge *collect_edges(const netmapper_topo *topo, size_t *count) {
+    size_t cap = 64, n = 0;
+    topo_edge *edges = malloc(cap * sizeof(topo_edge));
+    if (!edges) return NULL;
+    for (size_t di = 0; di < topo->ndests; di++) {
+        const topo_dest *d = &topo->dests[di];
+        int limit = path_len(topo, d);
+        int complete = path_complete(topo, d) || behind_unreach_router(topo, d);
+        uint64_t subnet = node_id(NODE_SUBNET, d->addr & NM_TOPO_SUBNET_MASK);
+        uint64_t prev = node_id(NODE_LOCAL, 0);
+        uint64_t known = prev;
+        int known_ttl = 0;
+        for (int t = 1; t <= limit + 1; t++) {
+            uint64_t cur;
+            if (t <= limit && d->hops[t] == d->addr) continue;
+            if (t <= limit && d->hops[t]) {
+                cur = node_id(NODE_ROUTER, d->hops[t]);
+                known = cur;
+                known_ttl = t;
+            } else if (t <= limit) {
+                int u = t + 1;
+                while (u <= limit && !d->hops[u]) u++;
+                uint64_t after = u <= limit ? node_id(NODE_ROUTER, d->hops[u]) : subnet;
+                cur = anon_id(known, after, t - known_ttl);
+            } else {
+                if (!complete) break;
+                cur = subnet;
+            }
+            if (cur == prev) continue;
+            if (n == cap) {
+                cap *= 2;
+                topo_edge *e = realloc(edges, cap * sizeof(topo_edge));
+                if (!e) { free(edges); return NULL; }
+                edges = e;
+            }
+            edges[n].from = prev;
+            edges[n].to = cur;
+            n++;
+            prev = cur;
+        }
+    }
+    qsort(edges, n, sizeof(topo_edge), edge_cmp);
+    size_t u = 0;
+    for (size_t k = 0; k < n; k++) {
+        if (u == 0 || edge_cmp(&edges[u - 1], &edges[k]) != 0) edges[u++] = edges[k];
+    }
+    *count = u;
+    return edges;
+}
+
+int netmapper_topo_export_dot(const netmapper_topo *topo, FILE *out) {
+    size_t nedges = 0;
+    topo_edge *edges = collect_edges(topo, &nedges);
+    if (!edges) return -1;
+    fprintf(out, "digraph netmapper {\n");
+    fprintf(out, "    rankdir=LR;\n");
+    fprintf(out, "    \"local\" [shape=doublecircle];\n");
+    for (size_t k = 0; k < nedges; k++) {
+        char from[64], to[64];
+        node_name(edges[k].from, from, sizeof(from));
+        node_name(edges[k].to, to, sizeof(to));
+        if ((edges[k].to >> 32) == NODE_SUBNET) fprintf(out, "    \"%s\" [shape=box];\n", to);
+        if ((edges[k].to >> 32) == NODE_ANON) fprintf(out, "    \"%s\" [label=\"*\", style=dashed];\n", to);
+        fprintf(out, "    \"%s\" -> \"%s\";\n", from, to);
+    }
+    fprintf(out, "}\n");
+    free(edges);
+    return ferror(out) ? -1 : 0;
+}
+
+int netmapper_topo_export_json(const netmapper_topo *topo, FILE *out) {
+    size_t nedges = 0;
+    topo_edge *edges = collect_edges(topo, &nedges);
+    if (!edges) return -1;
+    char a[64], b[64];
+    fprintf(out, "{\n  \"edges\": [");
+    for (size_t k = 0; k < nedges; k++) {
+        node_name(edges[k].from, a, sizeof(a));
+        node_name(edges[k].to, b, sizeof(b));
+        fprintf(out, "%s\n    {\"from\": \"%s\", \"to\": \"%s\"}", k ? "," : "", a, b);
+    }
+    fprintf(out, "\n  ],\n  \"subnets\": [");
+    int first = 1;
+    for (size_t k = 0; k < nedges; k++) {
+        if ((edges[k].to >> 32) != NODE_SUBNET) continue;
+        int router = (edges[k].from >> 32) == NODE_ROUTER;
+        node_name(edges[k].from, a, sizeof(a));
+        node_name(edges[k].to, b, sizeof(b));
+        fprintf(out, "%s\n    {\"subnet\": \"%s\", \"behind\": %s%s%s}", first ? "" : ",", b,
+            router ? "\"" : "", router ? a : "null", router ? "\"" : "");
+        first = 0;
+    }
+    fprintf(out, "\n  ],\n  \"paths\": [");
+    for (size_t di = 0; di < topo->ndests; di++) {
+        const topo_dest *d = &topo->dests[di];
+        int limit = path_len(topo, d);
+        node_name(node_id(NODE_ROUTER, d->addr), a, sizeof(a));
+        int loop = path_loop(topo, d);
+        uint32_t gw = dest_gateway(topo, d);
+        if (gw) node_name(node_id(NODE_ROUTER, gw), b, sizeof(b));
+        fprintf(out, "%s\n    {\"destination\": \"%s\", \"reached\": %s, \"unreachable\": %s, \"loop\": %s, \"gateway\": %s%s%s, \"hops\": [",
+            di ? "," : "", a, d->reached_ttl ? "true" : "false", path_unreachable(topo, d) ? "true" : "false", loop ? "true" : "false",
+            gw ? "\"" : "", gw ? b : "null", gw ? "\"" : "");
+        for (int t = 1; t <= limit; t++) {
+            if (d->hops[t]) {
+                node_name(node_id(NODE_ROUTER, d->hops[t]), b, sizeof(b));
+                fprintf(out, "%s\"%s\"", t > 1 ? ", " : "", b);
+            } else {
+                fprintf(out, "%snull", t > 1 ? ", " : "");
+            }
+        }
+        fprintf(out, "]}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+    free(edges);
+    return ferror(out) ? -1 : 0;
+}